@@ -17,6 +17,21 @@
 
 #include "aesd-circular-buffer.h"
 
+/**
+ * @return the index @param offs + @param step of the entry array, for @param step at most
+ * capacity.  Capacities are set at runtime and need not be powers of two, so a compare
+ * replaces the division a modulo by buffer->capacity would cost on every step.
+ */
+static inline uint32_t aesd_circular_buffer_wrap(const struct aesd_circular_buffer *buffer,
+    uint32_t offs, uint32_t step)
+{
+    uint32_t index = offs + step;
+
+    if (index >= buffer->capacity)
+        index -= buffer->capacity;
+    return index;
+}
+
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
@@ -26,6 +41,7 @@
  *      in aesd_buffer.
  * @return the struct aesd_buffer_entry structure representing the position described by char_offset, or
  * NULL if this position is not available in the buffer (not enough data is written).
+ * Binary search over the entries' stream offsets, O(log n) in the number of entries.
  */
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(
     struct aesd_circular_buffer *buffer, size_t target_offset, size_t *entry_offset_byte_rtn)
@@ -33,38 +49,31 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(
     if (buffer == NULL || entry_offset_byte_rtn == NULL)
         return NULL;
 
-    size_t accumulated_bytes = 0;  // Keeps track of total bytes processed
-    size_t entries_checked = 0;    // Counts how many entries we have searched
-    uint8_t current_index = buffer->out_offs;  // Start from the oldest entry
+    // Also covers the empty buffer, whose total_size is 0
+    if (target_offset >= buffer->total_size)
+        return NULL;
+
+    // Binary search for the last entry starting at or before target_offset
+    size_t base = buffer->entry[buffer->out_offs].stream_offset;
+    uint32_t low = 0;
+    uint32_t high = aesd_circular_buffer_count(buffer) - 1;
+    uint32_t index;
 
-    while (1)
+    while (low < high)
     {
-        // If target_offset falls inside this entry, return the entry
-        if (target_offset < (accumulated_bytes + buffer->entry[current_index].size))
-        {
-            *entry_offset_byte_rtn = target_offset - accumulated_bytes;
-            return &buffer->entry[current_index];
-        }
-
-        // Move to the next entry in the circular buffer
-        accumulated_bytes += buffer->entry[current_index].size;
-        current_index = (current_index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-        entries_checked++;
-
-        // Stop searching if the buffer is not full and we have checked all written data
-        if ((!buffer->full) && (current_index == buffer->in_offs))
-        {
-            return NULL;
-        }
-
-        // Stop searching if we have checked all entries in a full buffer
-        if (buffer->full && (entries_checked == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED))
-        {
-            return NULL;
-        }
+        uint32_t mid = low + (high - low + 1) / 2;
+
+        index = aesd_circular_buffer_wrap(buffer, buffer->out_offs, mid);
+        if (buffer->entry[index].stream_offset - base <= target_offset)
+            low = mid;
+        else
+            high = mid - 1;
     }
 
-    return NULL; // Should never reach here, but included for safety
+    index = aesd_circular_buffer_wrap(buffer, buffer->out_offs, low);
+
+    *entry_offset_byte_rtn = target_offset - (buffer->entry[index].stream_offset - base);
+    return &buffer->entry[index];
 }
 
 /**
@@ -79,20 +88,23 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
     if (buffer == NULL || add_entry == NULL)
         return;
 
-    // If buffer is NOT full, just add the entry and move the write position forward
-    if (!(buffer->full))
-    {
-        buffer->entry[buffer->in_offs] = *add_entry;
-        buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    }
-    else
+    struct aesd_buffer_entry *slot = &buffer->entry[buffer->in_offs];
+
+    // If buffer is full, the oldest entry is overwritten and the read position moves forward
+    if (buffer->full)
     {
-        // If buffer is full, overwrite the oldest entry
-        buffer->entry[buffer->in_offs] = *add_entry;
-        buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        buffer->total_size -= slot->size;
+        buffer->out_offs = aesd_circular_buffer_wrap(buffer, buffer->out_offs, 1);
     }
 
+    // Store the entry at its running position and move the write position forward
+    *slot = *add_entry;
+    slot->stream_offset = buffer->stream_end;
+    buffer->stream_end += add_entry->size;
+    buffer->seq_end++;
+    buffer->total_size += add_entry->size;
+    buffer->in_offs = aesd_circular_buffer_wrap(buffer, buffer->in_offs, 1);
+
     // If in_offs catches up with out_offs and buffer was not already full, mark it as full
     if ((buffer->in_offs == buffer->out_offs) && !(buffer->full))
     {
@@ -100,11 +112,109 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
     }
 }
 
+/**
+* Removes the oldest entry of @param buffer, copying it to @param removed_entry so the caller
+* can release its memory.
+* Any necessary locking must be handled by the caller
+* @return false if the buffer was empty
+*/
+bool aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer,
+    struct aesd_buffer_entry *removed_entry)
+{
+    if (buffer == NULL || removed_entry == NULL)
+        return false;
+
+    if (!buffer->full && buffer->in_offs == buffer->out_offs)
+        return false;
+
+    *removed_entry = buffer->entry[buffer->out_offs];
+    buffer->entry[buffer->out_offs].buffptr = NULL;
+    buffer->entry[buffer->out_offs].size = 0;
+    buffer->out_offs = aesd_circular_buffer_wrap(buffer, buffer->out_offs, 1);
+    buffer->total_size -= removed_entry->size;
+    buffer->full = false;
+    return true;
+}
+
+/**
+* @return the file position of the entry @param index places after the oldest one, in O(1)
+* Any necessary locking must be handled by the caller
+*/
+size_t aesd_circular_buffer_entry_fpos(const struct aesd_circular_buffer *buffer, uint32_t index)
+{
+    uint32_t physical = aesd_circular_buffer_wrap(buffer, buffer->out_offs, index);
+    return buffer->entry[physical].stream_offset - buffer->entry[buffer->out_offs].stream_offset;
+}
+
+/**
+* @return the sequence number of the oldest entry of @param buffer, the entry @param index
+* places after it has number first + index.  Equals seq_end when the buffer is empty.
+* Any necessary locking must be handled by the caller
+*/
+uint64_t aesd_circular_buffer_first_seqno(const struct aesd_circular_buffer *buffer)
+{
+    return buffer->seq_end - aesd_circular_buffer_count(buffer);
+}
+
+/**
+* @return the number of entries stored in @param buffer
+*/
+uint32_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer)
+{
+    if (buffer->full)
+        return buffer->capacity;
+    return aesd_circular_buffer_wrap(buffer, buffer->in_offs, buffer->capacity - buffer->out_offs);
+}
+
 /**
 * Initializes the circular buffer described by @param buffer to an empty struct
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    buffer->entry = buffer->entry_storage;
+    buffer->capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+/**
+* Initializes @param buffer to an empty buffer holding up to @param capacity entries in
+* @param storage, which must stay allocated (by the caller) for the lifetime of the buffer.
+*/
+void aesd_circular_buffer_init_storage(struct aesd_circular_buffer *buffer,
+    struct aesd_buffer_entry *storage, uint32_t capacity)
+{
+    memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    memset(storage,0,sizeof(*storage) * capacity);
+    buffer->entry = storage;
+    buffer->capacity = capacity;
+}
+
+/**
+* Moves the entries of @param buffer, oldest first, into @param storage of @param capacity
+* entries.  The caller must first remove entries with aesd_circular_buffer_remove_oldest()
+* until they fit.
+* Any necessary locking must be handled by the caller
+* @return the previous storage, for the caller to free unless it is buffer->entry_storage
+*/
+struct aesd_buffer_entry *aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer,
+    struct aesd_buffer_entry *storage, uint32_t capacity)
+{
+    struct aesd_buffer_entry *old_storage = buffer->entry;
+    uint32_t count = aesd_circular_buffer_count(buffer);
+    uint32_t i;
+
+    if (count > capacity)
+        return NULL;
+
+    memset(storage,0,sizeof(*storage) * capacity);
+    for (i = 0; i < count; i++)
+        storage[i] = buffer->entry[aesd_circular_buffer_wrap(buffer, buffer->out_offs, i)];
+
+    buffer->entry = storage;
+    buffer->capacity = capacity;
+    buffer->out_offs = 0;
+    buffer->in_offs = aesd_circular_buffer_wrap(buffer, 0, count);
+    buffer->full = (count == capacity);
+    return old_storage;
 }
 
@@ -17,8 +17,18 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Entry count of a buffer set up with aesd_circular_buffer_init(), which uses
+ * the storage embedded in struct aesd_circular_buffer
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
 
+/**
+ * Largest entry count accepted for external storage, see
+ * aesd_circular_buffer_init_storage()
+ */
+#define AESDCHAR_MAX_ENTRIES_LIMIT 65536
+
 struct aesd_buffer_entry
 {
     /**
@@ -29,27 +39,59 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Position of buffptr[0] among all bytes ever added to the buffer, set by
+     * aesd_circular_buffer_add_entry().  Entries keep these absolute positions
+     * when older ones are evicted, so file positions are found by subtracting
+     * the oldest entry's position instead of summing sizes.
+     */
+    size_t stream_offset;
 };
 
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of pointers to memory allocated for the most recent write operations,
+     * capacity entries long.  Points at entry_storage unless external storage was
+     * provided with aesd_circular_buffer_init_storage().
+     */
+    struct aesd_buffer_entry *entry;
+    /**
+     * Number of entries in the entry array
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint32_t capacity;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
     /**
      * set to true when the buffer entry structure is full
      */
     bool full;
+    /**
+     * Sum of the sizes of all stored entries
+     */
+    size_t total_size;
+    /**
+     * Number of bytes ever added, the stream_offset of the next entry
+     */
+    size_t stream_end;
+    /**
+     * Number of entries ever added, the sequence number of the next entry.
+     * The stored entries carry the count numbers below it, oldest first, so
+     * a command keeps its number however many older ones are evicted.
+     */
+    uint64_t seq_end;
+    /**
+     * Default storage used by aesd_circular_buffer_init().  A buffer using it must
+     * not be copied by value, entry would keep pointing at the original.
+     */
+    struct aesd_buffer_entry entry_storage[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
@@ -59,14 +101,29 @@ extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern void aesd_circular_buffer_init_storage(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *storage, uint32_t capacity);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *storage, uint32_t capacity);
+
+extern bool aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *removed_entry);
+
+extern uint32_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer);
+
+extern size_t aesd_circular_buffer_entry_fpos(const struct aesd_circular_buffer *buffer, uint32_t index);
+
+extern uint64_t aesd_circular_buffer_first_seqno(const struct aesd_circular_buffer *buffer);
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -75,7 +132,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<(buffer)->capacity; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
@@ -0,0 +1,187 @@
+/**
+ * @file aesd-ring-lockfree.h
+ * @brief Lock-free single- and multi-producer rings for userspace threads
+ *
+ * The rings of aesd-ring.h leave all locking to the caller.  These variants
+ * hand elements from producer threads to one consumer thread with C11
+ * atomics only, for queues such as completed lines going from connection
+ * threads to a single writer thread:
+ *
+ * AESD_SPSC_RING_DEFINE(name, type, order) defines struct name for exactly
+ * one producer and one consumer thread.  Each side owns one free running
+ * index and keeps a cached copy of the other one, so a push or pop touches
+ * the other side's cache line only when its cached view says full or empty.
+ *
+ * AESD_MPSC_RING_DEFINE(name, type, order) defines struct name for any
+ * number of producer threads and one consumer thread.  Producers claim
+ * slots with a compare-and-swap on head; every slot carries a sequence
+ * number telling whether it is free for the producer of a given lap or
+ * holds an element for the consumer, so a producer that is slow to fill its
+ * claimed slot never exposes a half-written element.
+ *
+ * Both define static inline name_init(), name_capacity(),
+ * name_push(ring, elem) returning false when full and name_pop(ring, elem)
+ * returning false when empty.  Neither blocks: waiting for room or for
+ * elements is up to the caller.  head, tail and the slots start on separate
+ * cache lines so producers and the consumer do not false share.  As with
+ * AESD_RING_DEFINE(), pointer element types need a typedef.
+ *
+ * Userspace only, the driver uses kernel primitives instead.
+ *
+ * @author Parth Varsani
+ */
+
+#ifndef AESD_RING_LOCKFREE_H
+#define AESD_RING_LOCKFREE_H
+
+#ifdef __KERNEL__
+#error "aesd-ring-lockfree.h uses C11 atomics and is for userspace only"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#define AESD_RING_CACHE_LINE 64
+
+/* Sequence numbers are compared as int32_t differences, which needs capacity < 2^31 */
+#define AESD_RING_LOCKFREE_MAX_ORDER 30
+
+#define AESD_SPSC_RING_DEFINE(name, type, order)                                        \
+_Static_assert((order) >= 0 && (order) <= AESD_RING_LOCKFREE_MAX_ORDER,                 \
+               #name ": order out of range");                                           \
+                                                                                        \
+struct name                                                                             \
+{                                                                                       \
+    /* Producer side: the next slot written and its view of tail */                    \
+    _Alignas(AESD_RING_CACHE_LINE) _Atomic uint32_t head;                               \
+    uint32_t tail_cache;                                                                \
+    /* Consumer side: the next slot read and its view of head */                       \
+    _Alignas(AESD_RING_CACHE_LINE) _Atomic uint32_t tail;                               \
+    uint32_t head_cache;                                                                \
+    _Alignas(AESD_RING_CACHE_LINE) type entry[1u << (order)];                           \
+};                                                                                      \
+                                                                                        \
+static inline void name##_init(struct name *ring)                                       \
+{                                                                                       \
+    atomic_init(&ring->head, 0);                                                        \
+    atomic_init(&ring->tail, 0);                                                        \
+    ring->tail_cache = 0;                                                               \
+    ring->head_cache = 0;                                                               \
+}                                                                                       \
+                                                                                        \
+static inline uint32_t name##_capacity(void)                                            \
+{                                                                                       \
+    return 1u << (order);                                                               \
+}                                                                                       \
+                                                                                        \
+/* Producer thread only */                                                              \
+static inline bool name##_push(struct name *ring, const type *elem)                     \
+{                                                                                       \
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);            \
+                                                                                        \
+    if (head - ring->tail_cache == name##_capacity()) {                                 \
+        ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);     \
+        if (head - ring->tail_cache == name##_capacity())                               \
+            return false;                                                               \
+    }                                                                                   \
+    ring->entry[head & (name##_capacity() - 1)] = *elem;                                \
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);                 \
+    return true;                                                                        \
+}                                                                                       \
+                                                                                        \
+/* Consumer thread only */                                                              \
+static inline bool name##_pop(struct name *ring, type *elem)                            \
+{                                                                                       \
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);            \
+                                                                                        \
+    if (tail == ring->head_cache) {                                                     \
+        ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);     \
+        if (tail == ring->head_cache)                                                   \
+            return false;                                                               \
+    }                                                                                   \
+    *elem = ring->entry[tail & (name##_capacity() - 1)];                                \
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);                 \
+    return true;                                                                        \
+}
+
+#define AESD_MPSC_RING_DEFINE(name, type, order)                                        \
+/* With one slot a filled slot's pos + 1 would read as free for the next lap */        \
+_Static_assert((order) >= 1 && (order) <= AESD_RING_LOCKFREE_MAX_ORDER,                 \
+               #name ": order out of range");                                           \
+                                                                                        \
+struct name##_slot                                                                      \
+{                                                                                       \
+    /* pos while free for the producer claiming position pos, pos + 1 once it          \
+     * holds that producer's element */                                                 \
+    _Atomic uint32_t seq;                                                               \
+    type value;                                                                         \
+};                                                                                      \
+                                                                                        \
+struct name                                                                             \
+{                                                                                       \
+    _Alignas(AESD_RING_CACHE_LINE) _Atomic uint32_t head;   /* claimed by producers */  \
+    _Alignas(AESD_RING_CACHE_LINE) uint32_t tail;           /* consumer only */         \
+    _Alignas(AESD_RING_CACHE_LINE) struct name##_slot slot[1u << (order)];              \
+};                                                                                      \
+                                                                                        \
+static inline uint32_t name##_capacity(void)                                            \
+{                                                                                       \
+    return 1u << (order);                                                               \
+}                                                                                       \
+                                                                                        \
+static inline void name##_init(struct name *ring)                                       \
+{                                                                                       \
+    uint32_t i;                                                                         \
+                                                                                        \
+    for (i = 0; i < name##_capacity(); i++)                                             \
+        atomic_init(&ring->slot[i].seq, i);                                             \
+    atomic_init(&ring->head, 0);                                                        \
+    ring->tail = 0;                                                                     \
+}                                                                                       \
+                                                                                        \
+/* Any thread */                                                                        \
+static inline bool name##_push(struct name *ring, const type *elem)                     \
+{                                                                                       \
+    uint32_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);             \
+    struct name##_slot *slot;                                                           \
+                                                                                        \
+    for (;;) {                                                                          \
+        int32_t diff;                                                                   \
+                                                                                        \
+        slot = &ring->slot[pos & (name##_capacity() - 1)];                              \
+        diff = (int32_t)(atomic_load_explicit(&slot->seq, memory_order_acquire) - pos); \
+        if (diff == 0) {                                                                \
+            /* Free for this lap, claim it unless another producer did first */        \
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,       \
+                                                      memory_order_relaxed,             \
+                                                      memory_order_relaxed))            \
+                break;                                                                  \
+        } else if (diff < 0) {                                                          \
+            return false;   /* still holds the element of the previous lap */          \
+        } else {                                                                        \
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);              \
+        }                                                                               \
+    }                                                                                   \
+    slot->value = *elem;                                                                \
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);                   \
+    return true;                                                                        \
+}                                                                                       \
+                                                                                        \
+/* Consumer thread only.  Also false while the oldest claimed slot is still            \
+ * being filled, elements are always popped in claim order. */                          \
+static inline bool name##_pop(struct name *ring, type *elem)                            \
+{                                                                                       \
+    struct name##_slot *slot = &ring->slot[ring->tail & (name##_capacity() - 1)];       \
+                                                                                        \
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != ring->tail + 1)       \
+        return false;                                                                   \
+    *elem = slot->value;                                                                \
+    atomic_store_explicit(&slot->seq, ring->tail + name##_capacity(),                   \
+                          memory_order_release);                                        \
+    ring->tail++;                                                                       \
+    return true;                                                                        \
+}
+
+#endif /* AESD_RING_LOCKFREE_H */
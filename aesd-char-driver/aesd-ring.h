@@ -0,0 +1,128 @@
+/**
+ * @file aesd-ring.h
+ * @brief Fixed-capacity ring buffers generated per element type
+ *
+ * AESD_RING_DEFINE(name, type, order) defines struct name, a FIFO of
+ * 1 << order elements of type stored inline, and static inline functions
+ * operating on it:
+ *
+ *     name_init(ring)                      empty the ring
+ *     name_capacity()                      1 << order
+ *     name_count(ring)                     elements stored
+ *     name_empty(ring), name_full(ring)
+ *     name_push(ring, elem)                append, false if full
+ *     name_push_overwrite(ring, elem, evicted)
+ *                                          append, overwriting the oldest
+ *                                          element when full like
+ *                                          aesd_circular_buffer_add_entry()
+ *     name_pop(ring, elem)                 remove the oldest, false if empty
+ *     name_peek(ring, index)               element index places after the
+ *                                          oldest, NULL if not stored
+ *
+ * The in and out indices run freely and are masked on every access, so no
+ * step needs a modulo or a wrap branch, and count is always in - out without
+ * the full flag aesd_circular_buffer needs to tell a full ring from an empty
+ * one.  Elements are copied in and out by value; for pointer elements pass
+ * a typedef as type, so const applies to the element rather than the target.
+ *
+ * Like aesd_circular_buffer, any necessary locking must be performed by the
+ * caller.  Usable from the kernel and from userspace.
+ *
+ * @author Parth Varsani
+ */
+
+#ifndef AESD_RING_H
+#define AESD_RING_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stddef.h> // NULL
+#include <stdint.h> // uintx_t
+#include <stdbool.h>
+#endif
+
+/* order is limited so in - out always fits the uint32_t indices */
+#define AESD_RING_MAX_ORDER 31
+
+#define AESD_RING_DEFINE(name, type, order)                                             \
+_Static_assert((order) >= 0 && (order) <= AESD_RING_MAX_ORDER,                          \
+               #name ": order out of range");                                           \
+                                                                                        \
+struct name                                                                             \
+{                                                                                       \
+    type entry[1u << (order)];                                                          \
+    uint32_t in;    /* entry[in & mask] is the next slot written */                     \
+    uint32_t out;   /* entry[out & mask] is the oldest element, when in != out */       \
+};                                                                                      \
+                                                                                        \
+static inline void name##_init(struct name *ring)                                       \
+{                                                                                       \
+    ring->in = 0;                                                                       \
+    ring->out = 0;                                                                      \
+}                                                                                       \
+                                                                                        \
+static inline uint32_t name##_capacity(void)                                            \
+{                                                                                       \
+    return 1u << (order);                                                               \
+}                                                                                       \
+                                                                                        \
+static inline uint32_t name##_count(const struct name *ring)                            \
+{                                                                                       \
+    return ring->in - ring->out;                                                        \
+}                                                                                       \
+                                                                                        \
+static inline bool name##_empty(const struct name *ring)                                \
+{                                                                                       \
+    return ring->in == ring->out;                                                       \
+}                                                                                       \
+                                                                                        \
+static inline bool name##_full(const struct name *ring)                                 \
+{                                                                                       \
+    return name##_count(ring) == name##_capacity();                                     \
+}                                                                                       \
+                                                                                        \
+static inline bool name##_push(struct name *ring, const type *elem)                     \
+{                                                                                       \
+    if (name##_full(ring))                                                              \
+        return false;                                                                   \
+    ring->entry[ring->in++ & (name##_capacity() - 1)] = *elem;                          \
+    return true;                                                                        \
+}                                                                                       \
+                                                                                        \
+/* @return true if the ring was full and its oldest element, copied to                \
+ * @evicted unless NULL, was dropped to make room */                                    \
+static inline bool name##_push_overwrite(struct name *ring, const type *elem,           \
+                                         type *evicted)                                 \
+{                                                                                       \
+    bool full = name##_full(ring);                                                      \
+                                                                                        \
+    if (full) {                                                                         \
+        if (evicted)                                                                    \
+            *evicted = ring->entry[ring->out & (name##_capacity() - 1)];                \
+        ring->out++;                                                                    \
+    }                                                                                   \
+    ring->entry[ring->in++ & (name##_capacity() - 1)] = *elem;                          \
+    return full;                                                                        \
+}                                                                                       \
+                                                                                        \
+/* @return false if the ring was empty, else the oldest element is removed             \
+ * and copied to @elem unless NULL */                                                   \
+static inline bool name##_pop(struct name *ring, type *elem)                            \
+{                                                                                       \
+    if (name##_empty(ring))                                                             \
+        return false;                                                                   \
+    if (elem)                                                                           \
+        *elem = ring->entry[ring->out & (name##_capacity() - 1)];                       \
+    ring->out++;                                                                        \
+    return true;                                                                        \
+}                                                                                       \
+                                                                                        \
+static inline type *name##_peek(struct name *ring, uint32_t index)                      \
+{                                                                                       \
+    if (index >= name##_count(ring))                                                    \
+        return NULL;                                                                    \
+    return &ring->entry[(ring->out + index) & (name##_capacity() - 1)];                 \
+}
+
+#endif /* AESD_RING_H */
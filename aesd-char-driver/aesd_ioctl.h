@@ -36,11 +36,139 @@ struct aesd_seekto {
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
+/**
+ * Retention limits of the device, see AESDCHAR_IOCSETLIMITS
+ */
+struct aesd_limits {
+    /**
+     * Number of write commands kept, 1 to AESDCHAR_MAX_ENTRIES_LIMIT
+     */
+    uint32_t max_entries;
+    uint32_t reserved;
+    /**
+     * Total bytes kept across all commands, 0 for no byte limit.  The newest
+     * command is always kept, even when larger than the limit.
+     */
+    uint64_t max_bytes;
+};
+
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Change the retention limits, evicting the oldest commands that no longer fit
+#define AESDCHAR_IOCSETLIMITS _IOW(AESD_IOC_MAGIC, 2, struct aesd_limits)
+// Read the current retention limits
+#define AESDCHAR_IOCGETLIMITS _IOR(AESD_IOC_MAGIC, 3, struct aesd_limits)
+/**
+ * Takes a uint32_t, nonzero to switch the file to tail mode: reads continue
+ * from where the previous read ended even after older commands are evicted,
+ * and at the end of the data they wait for the next command (or fail with
+ * EAGAIN on an O_NONBLOCK file) instead of returning 0.  poll() reports
+ * POLLIN whenever a read would not wait.
+ */
+#define AESDCHAR_IOCSETTAIL _IOW(AESD_IOC_MAGIC, 4, uint32_t)
+// Read the driver's counters
+#define AESDCHAR_IOCGETSTATS _IOR(AESD_IOC_MAGIC, 5, struct aesd_stats)
+/**
+ * Copy whole commands, their sequence numbers, payload offsets and sizes to
+ * user buffers in one call, see struct aesd_fetch.  Returns 0 with count 0
+ * when no command at or after seq is stored yet.  Does not move the file
+ * position.
+ */
+#define AESDCHAR_IOCFETCH _IOWR(AESD_IOC_MAGIC, 6, struct aesd_fetch)
+/**
+ * Takes a uint64_t command sequence number and moves the file position to
+ * the start of that command, or of the oldest stored one if it was evicted,
+ * writing back the sequence number actually positioned at.  The number the
+ * next command will get positions at the end.  Works in tail mode too.
+ */
+#define AESDCHAR_IOCSEEKSEQ _IOWR(AESD_IOC_MAGIC, 7, uint64_t)
+/**
+ * Counters since the module was loaded, see AESDCHAR_IOCGETSTATS
+ */
+struct aesd_stats {
+    uint64_t writes;            /* write()/writev() calls that stored bytes */
+    uint64_t commands;          /* commands completed */
+    uint64_t evictions;         /* commands dropped to make room for newer ones */
+    uint64_t allocations;       /* memory allocations made by the driver */
+    uint64_t storage_bytes;     /* bytes held for the ring, its header and the entry array */
+    uint64_t entries;           /* commands currently stored */
+    uint64_t bytes;             /* bytes of the commands currently stored */
+    uint64_t lock_wait_ns;      /* time writers spent waiting for the device lock */
+    uint64_t first_seq;         /* sequence number of the oldest stored command */
+    uint64_t next_seq;          /* sequence number the next command will get */
+};
+
+/**
+ * Every command gets a sequence number when it is stored, counting up from 0
+ * since the module was loaded and never reused, so a consumer can remember
+ * the last one it handled and resume after it even once older commands have
+ * been evicted.
+ */
+
+/**
+ * One command returned by AESDCHAR_IOCFETCH
+ */
+struct aesd_fetch_entry {
+    uint64_t seq;               /* sequence number of the command */
+    uint64_t offset;            /* where its bytes start in the payload buffer */
+    uint64_t size;              /* its length in bytes, including the newline */
+};
+
+/**
+ * Argument of AESDCHAR_IOCFETCH
+ */
+struct aesd_fetch {
+    /**
+     * In: sequence number of the first command wanted.  Out: the sequence
+     * number of the first command returned, higher than requested when the
+     * requested ones were already evicted.
+     */
+    uint64_t seq;
+    uint64_t buf;               /* in: user address of the payload buffer */
+    uint64_t buf_len;           /* in: size of the payload buffer */
+    uint64_t entries;           /* in: user address of an aesd_fetch_entry array */
+    uint32_t max_entries;       /* in: length of that array, at most AESDCHAR_FETCH_MAX_ENTRIES */
+    uint32_t count;             /* out: commands returned */
+    /**
+     * Out: payload bytes copied, or with ENOSPC the size of the first
+     * command, which did not fit in buf_len
+     */
+    uint64_t bytes;
+    uint64_t next_seq;          /* out: seq to pass to fetch the following commands */
+};
+
+#define AESDCHAR_FETCH_MAX_ENTRIES 4096
+
+/**
+ * mmap() layout of the device, read-only:
+ * - page 0 holds a struct aesd_ring_header
+ * - the next data_size / page size pages hold the ring of stored bytes, and
+ *   the same pages are mapped again right after them, so any data_size bytes
+ *   starting anywhere in the first copy are contiguous
+ *
+ * Every byte ever written has a stream position; the byte at position p is
+ * at data[p & (data_size - 1)].  To consume bytes without a read() call:
+ * 1. read seq, retrying while it is odd, then head and tail, and retry all
+ *    three if seq changed (acquire ordering on the loads)
+ * 2. use the bytes from a position in [head, tail) up to tail
+ * 3. read reclaim: if it is above the first position used, the driver may
+ *    have overwritten those bytes meanwhile, so discard them and restart
+ */
+struct aesd_ring_header {
+    uint32_t magic;         /* AESDCHAR_RING_MAGIC */
+    uint32_t page_size;     /* size of the header page, data starts after it */
+    uint64_t data_size;     /* bytes in the ring, a power of two */
+    uint64_t seq;           /* odd while the driver updates head and tail */
+    uint64_t head;          /* stream position of the oldest stored command */
+    uint64_t tail;          /* stream position just past the newest complete command */
+    uint64_t reclaim;       /* bytes before this stream position may be overwritten */
+};
+
+#define AESDCHAR_RING_MAGIC 0x61657364  /* "aesd" */
+
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 7
 
 #endif /* AESD_IOCTL_H */
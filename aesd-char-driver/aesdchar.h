@@ -11,24 +11,88 @@
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
 #include <linux/cdev.h>
+#include <linux/printk.h>
 #include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/wait.h>
+#include <linux/atomic.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
 #include "aesd-circular-buffer.h"
+#include "aesd_ioctl.h"
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
-
+/*
+ * In the kernel PDEBUG is pr_debug(): with CONFIG_DYNAMIC_DEBUG each call is
+ * a patched-out branch until enabled at runtime, e.g.
+ *     echo 'module aesdchar +p' > /sys/kernel/debug/dynamic_debug/control
+ * and without it the calls are compiled out unless built with DEBUG=y.
+ */
 #undef PDEBUG             /* undef it, just in case */
-#ifdef AESD_DEBUG
-#  ifdef __KERNEL__
-     /* This one if debugging is on, and kernel space */
-#    define PDEBUG(fmt, args...) printk( KERN_DEBUG "aesdchar: " fmt, ## args)
-#  else
+#ifdef __KERNEL__
+#  define PDEBUG(fmt, args...) pr_debug("aesdchar: " fmt, ## args)
+#elif defined(AESD_DEBUG)
      /* This one for user space */
-#    define PDEBUG(fmt, args...) fprintf(stderr, fmt, ## args)
-#  endif
+#  define PDEBUG(fmt, args...) fprintf(stderr, fmt, ## args)
 #else
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+/* Largest nr_devices module parameter accepted */
+#define AESDCHAR_MAX_DEVICES 256
+
+/* Largest ring_size module parameter accepted */
+#define AESDCHAR_MAX_RING_SIZE (1UL << 30)
+
+/* Lock time histograms count durations in power-of-two nanosecond buckets */
+#define AESD_HIST_BUCKETS 32
+
+/**
+ * Hot path counters, kept per CPU so lockless readers and writers never
+ * share a cache line to update them
+ */
+struct aesd_counters
+{
+    u64 writes;                          /* write()/writev() calls that stored bytes */
+    u64 bytes_in;
+    u64 reads;                           /* read() calls that returned data */
+    u64 bytes_out;
+    u64 partial_chunks;                  /* Staging chunks allocated */
+};
+
+/**
+ * dev->lock contention, updated by the lock holder, see aesd_lock()
+ */
+struct aesd_lock_stats
+{
+    u64 contended;                       /* Acquisitions that had to wait */
+    u64 wait_hist[AESD_HIST_BUCKETS];    /* Wait time of contended acquisitions */
+    u64 hold_hist[AESD_HIST_BUCKETS];    /* Time from acquisition to release */
+    u64 acquired_ns;                     /* When the current holder took the lock */
+};
+
+/**
+ * Completed commands a writer waits to have stored, see aesd_stage_commands()
+ */
+struct aesd_staged
+{
+    struct list_head list;
+    u64 ticket;                          /* Global staging order across CPUs */
+    struct aesd_file *file;              /* Its first len staged bytes are the commands */
+    size_t len;
+    bool taken;                          /* Spliced off the staging list by a combining writer */
+    bool stored;                         /* Set by the combining writer, then the entry is gone */
+};
+
+/**
+ * Per CPU list of staged commands, in ticket order
+ */
+struct aesd_stage
+{
+    spinlock_t lock;
+    struct list_head list;
+};
+
 struct aesd_dev
 {
     /**
@@ -36,15 +100,57 @@ struct aesd_dev
      */
     struct cdev cdev;     			/* Char device structure      */
     struct aesd_circular_buffer buffer;  	// Circular buffer to store writes
-    struct mutex lock;  			// Mutex for thread safety
-    char *partial_write;                 /* Buffer for incomplete writes */
-    size_t partial_size;                 /* Size of incomplete writes */
+    struct mutex lock;  			// Serializes writers
+    seqcount_mutex_t seq;                /* Bumped around buffer changes, for lockless readers */
+    wait_queue_head_t readq;             /* Woken when writes complete commands */
+    size_t partial_size;                 /* Bytes of an incomplete command left by a closed file, stored after the last command */
+    size_t max_bytes;                    /* Byte budget for stored commands, 0 if unlimited */
+    /* Page-backed ring holding the bytes of all commands, also mapped by mmap() */
+    struct page **ring_pages;            /* ring_size / PAGE_SIZE data pages */
+    char *ring;                          /* data pages mapped twice in a row */
+    size_t ring_size;                    /* power of two */
+    size_t reclaim;                      /* stream positions below this may be overwritten */
+    struct page *header_page;
+    struct aesd_ring_header *header;     /* ring state published to mmap() readers */
+    struct aesd_stats stats;             /* Counters updated under lock, see AESDCHAR_IOCGETSTATS */
+    atomic_long_t allocations;           /* Allocations made, including lockless open() and writes */
+    struct aesd_counters __percpu *counters;
+    struct aesd_lock_stats lockstat;
+    struct dentry *debugfs;              /* Per device debugfs directory */
+    struct aesd_stage __percpu *stage;   /* Staging lists with percpu_staging, else NULL */
+    wait_queue_head_t stageq;            /* Writers waiting for their staged commands or dev->lock */
+    atomic64_t stage_ticket;
+    atomic64_t lock_wait_ns;             /* Time writers waited for dev->lock or a combining writer */
+};
+
+/**
+ * One page of a file's staged incomplete command, see aesd_file_stage()
+ */
+struct aesd_chunk
+{
+    struct list_head list;
+    size_t start;                        /* Staged bytes are data[start, len) */
+    size_t len;
+    char data[];
+};
+
+/**
+ * Per open file state, filp->private_data
+ */
+struct aesd_file
+{
+    struct aesd_dev *dev;
+    bool tail;                           /* Reads follow stream_pos and wait for new commands */
+    size_t stream_pos;                   /* Stream position of the next byte read in tail mode */
+    struct mutex lock;                   /* Serializes writers, guards the staged bytes */
+    struct list_head chunks;             /* Staged bytes of this file's incomplete command */
+    size_t partial_size;
 };
 
 int aesd_open(struct inode *inode, struct file *filp);
 int aesd_release(struct inode *inode, struct file *filp);
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos);
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos);
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from);
 int aesd_init_module(void);
 void aesd_cleanup_module(void);
 
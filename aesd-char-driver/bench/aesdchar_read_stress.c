@@ -0,0 +1,265 @@
+/**
+ * @file aesdchar_read_stress.c
+ * @brief Read scaling stress test for a loaded aesdchar driver
+ *
+ * Runs 1, 2, 4, ... reader threads up to the number of online CPUs, each
+ * reading the whole device from offset 0 in a loop, while a writer thread
+ * keeps appending commands so readers race with eviction.  Reports the
+ * aggregate read rate per thread count; with lockless readers it should grow
+ * with the thread count instead of flattening on dev->lock.
+ *
+ * Every command read back is checked to be one the writer produced, which
+ * catches torn reads of an evicted entry, so start from a freshly loaded
+ * module.
+ *
+ * Build and run from aesd-char-driver/ with the module loaded:
+ *     gcc -O2 -Wall -pthread -I. bench/aesdchar_read_stress.c -o aesdchar_read_stress
+ *     ./aesdchar_read_stress [-d /dev/aesdchar] [-s seconds] [-n] [-m]
+ * -n runs without the writer thread, -m makes readers consume the mmap()
+ * ring view instead of calling read().
+ *
+ * @author Parth Varsani
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "aesd_ioctl.h"
+
+#define READ_BUF_LEN (64 * 1024)
+
+/* Commands written are "stress NNNNNNNN\n" */
+#define CMD_PREFIX "stress "
+#define CMD_LEN (sizeof(CMD_PREFIX) - 1 + 8 + 1)
+
+static const char *g_device = "/dev/aesdchar";
+static atomic_bool g_stop;
+static atomic_ullong g_reads;
+static atomic_ullong g_bytes;
+static atomic_ullong g_bad;
+static bool g_use_mmap;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief Count the lines in @param buf that are not writer commands.
+ * Partial lines at either end of a read are skipped.
+ */
+static unsigned long count_bad_lines(const char *buf, size_t len)
+{
+    const char *pos = memchr(buf, '\n', len);
+    unsigned long bad = 0;
+
+    while (pos && (size_t)(pos + 1 - buf) < len) {
+        const char *line = pos + 1;
+        const char *nl = memchr(line, '\n', buf + len - line);
+        if (!nl)
+            break;
+        if ((size_t)(nl + 1 - line) != CMD_LEN ||
+            strncmp(line, CMD_PREFIX, strlen(CMD_PREFIX)) != 0)
+            bad++;
+        pos = nl;
+    }
+    return bad;
+}
+
+static void *reader_thread(void *arg)
+{
+    char *buf = malloc(READ_BUF_LEN);
+    int fd = open(g_device, O_RDONLY);
+    (void)arg;
+
+    if (fd < 0 || !buf) {
+        perror(g_device);
+        free(buf);
+        return NULL;
+    }
+
+    while (!atomic_load_explicit(&g_stop, memory_order_relaxed)) {
+        ssize_t n;
+        off_t pos = 0;
+
+        while ((n = pread(fd, buf, READ_BUF_LEN, pos)) > 0) {
+            pos += n;
+            atomic_fetch_add_explicit(&g_bytes, n, memory_order_relaxed);
+            atomic_fetch_add_explicit(&g_bad, count_bad_lines(buf, n), memory_order_relaxed);
+        }
+        if (n < 0 && errno != EINTR) {
+            perror("read");
+            break;
+        }
+        atomic_fetch_add_explicit(&g_reads, 1, memory_order_relaxed);
+    }
+
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+/**
+ * @brief Consume the device through its mmap() view, following the protocol
+ * described with struct aesd_ring_header, without any syscall per pass.
+ */
+static void *mmap_reader_thread(void *arg)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    int fd = open(g_device, O_RDONLY);
+    volatile struct aesd_ring_header *header;
+    const char *data;
+    size_t map_len;
+    (void)arg;
+
+    if (fd < 0) {
+        perror(g_device);
+        return NULL;
+    }
+    header = mmap(NULL, page_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return NULL;
+    }
+    map_len = page_size + 2 * header->data_size;
+    munmap((void *)header, page_size);
+    header = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return NULL;
+    }
+    data = (const char *)header + header->page_size;
+
+    while (!atomic_load_explicit(&g_stop, memory_order_relaxed)) {
+        uint64_t seq, head, tail;
+        unsigned long bad;
+        size_t len;
+
+        do {
+            while ((seq = __atomic_load_n(&header->seq, __ATOMIC_ACQUIRE)) & 1)
+                ;
+            head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+            tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+        } while (__atomic_load_n(&header->seq, __ATOMIC_ACQUIRE) != seq);
+
+        /* Whole history in one contiguous view, thanks to the double mapping */
+        len = tail - head;
+        bad = count_bad_lines(data + (head & (header->data_size - 1)), len);
+        if (__atomic_load_n(&header->reclaim, __ATOMIC_ACQUIRE) > head)
+            continue;   /* overwritten while scanning, the result is void */
+
+        atomic_fetch_add_explicit(&g_bytes, len, memory_order_relaxed);
+        atomic_fetch_add_explicit(&g_bad, bad, memory_order_relaxed);
+        atomic_fetch_add_explicit(&g_reads, 1, memory_order_relaxed);
+    }
+
+    munmap((void *)header, map_len);
+    close(fd);
+    return NULL;
+}
+
+static void *writer_thread(void *arg)
+{
+    int fd = open(g_device, O_WRONLY);
+    unsigned long seq = 0;
+    char cmd[CMD_LEN + 1];
+    (void)arg;
+
+    if (fd < 0) {
+        perror(g_device);
+        return NULL;
+    }
+
+    while (!atomic_load_explicit(&g_stop, memory_order_relaxed)) {
+        snprintf(cmd, sizeof(cmd), CMD_PREFIX "%08lu\n", seq++ % 100000000ul);
+        if (write(fd, cmd, CMD_LEN) < 0) {
+            perror("write");
+            break;
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    double seconds = 2.0;
+    bool with_writer = true;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:s:nm")) != -1) {
+        switch (opt) {
+        case 'd':
+            g_device = optarg;
+            break;
+        case 's':
+            seconds = atof(optarg);
+            break;
+        case 'n':
+            with_writer = false;
+            break;
+        case 'm':
+            g_use_mmap = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d device] [-s seconds] [-n] [-m]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    printf("%8s %14s %12s %10s\n", "readers", "full reads/s", "MiB/s", "bad lines");
+    for (long readers = 1; readers <= (cpus > 0 ? cpus : 1); readers *= 2) {
+        pthread_t threads[readers];
+        pthread_t writer;
+        uint64_t start, elapsed;
+
+        atomic_store(&g_stop, false);
+        atomic_store(&g_reads, 0);
+        atomic_store(&g_bytes, 0);
+        atomic_store(&g_bad, 0);
+
+        if (with_writer && pthread_create(&writer, NULL, writer_thread, NULL) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+        start = now_ns();
+        for (long i = 0; i < readers; i++) {
+            if (pthread_create(&threads[i], NULL,
+                               g_use_mmap ? mmap_reader_thread : reader_thread, NULL) != 0) {
+                perror("pthread_create");
+                return 1;
+            }
+        }
+
+        usleep((useconds_t)(seconds * 1e6));
+        atomic_store(&g_stop, true);
+        for (long i = 0; i < readers; i++)
+            pthread_join(threads[i], NULL);
+        elapsed = now_ns() - start;
+        if (with_writer)
+            pthread_join(writer, NULL);
+
+        printf("%8ld %14.0f %12.1f %10llu\n", readers,
+               atomic_load(&g_reads) * 1e9 / elapsed,
+               atomic_load(&g_bytes) * 1e9 / elapsed / (1024 * 1024),
+               atomic_load(&g_bad));
+    }
+    return atomic_load(&g_bad) != 0;
+}
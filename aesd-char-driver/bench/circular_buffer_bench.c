@@ -0,0 +1,393 @@
+/**
+ * @file circular_buffer_bench.c
+ * @brief Userspace benchmark suite for the aesd-circular-buffer hot paths
+ *
+ * Runs three groups of measurements and prints one result row for each:
+ * - add: aesd_circular_buffer_add_entry() throughput on a full buffer, where
+ *   every add evicts the oldest entry as the driver's writes do
+ * - find: aesd_circular_buffer_find_entry_offset_for_fpos() latency for
+ *   random file positions, which every read pays, across buffer depths and
+ *   entry size distributions
+ * - contended: 1, 2, 4, ... threads sharing one buffer behind a mutex, the
+ *   way dev->lock protects it, mixing one add per ADDS_EVERY lookups
+ *
+ * Rows are printed as an aligned table, CSV (-f csv) or a JSON array
+ * (-f json) with the same fields, so results can be diffed between commits.
+ * ns_per_op is wall time over the operations of all threads, so for the
+ * contended rows it falls as the lock scales and rises as it collapses.
+ *
+ * Build with the circular_buffer_bench CMake target, or from aesd-char-driver/:
+ *     gcc -O2 -Wall -pthread -I. bench/circular_buffer_bench.c aesd-circular-buffer.c -o circular_buffer_bench
+ *     ./circular_buffer_bench [-f text|csv|json] [-s seconds] [-t max_threads]
+ *
+ * @author Parth Varsani
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "aesd-circular-buffer.h"
+
+/* Operations are timed in batches until the measurement time has passed */
+#define BATCH 1000
+
+/* Depth of the buffer shared by the contended runs */
+#define CONTENDED_DEPTH 1000
+
+/* Contended threads add one entry per this many operations */
+#define ADDS_EVERY 8
+
+/* Largest entry size any distribution produces */
+#define PAYLOAD_LEN 4096
+
+enum output_format {
+    FORMAT_TEXT,
+    FORMAT_CSV,
+    FORMAT_JSON,
+};
+
+/**
+ * Entry size distributions, from the fixed-size lines a test script writes
+ * to the mostly-small-with-bursts mix of a busy socket server
+ */
+enum size_dist {
+    SIZE_FIXED,             /* every entry 64 bytes */
+    SIZE_UNIFORM,           /* 1..256 bytes */
+    SIZE_SKEWED,            /* 90% 1..32 bytes, 10% 1..PAYLOAD_LEN bytes */
+    SIZE_DIST_COUNT,
+};
+
+static const char *const size_dist_names[SIZE_DIST_COUNT] = {
+    [SIZE_FIXED] = "fixed64",
+    [SIZE_UNIFORM] = "uniform256",
+    [SIZE_SKEWED] = "skewed",
+};
+
+static enum output_format g_format = FORMAT_TEXT;
+static uint64_t g_runtime_ns = 200000000ull;
+static unsigned int g_rows;
+static char g_payload[PAYLOAD_LEN];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief xorshift64, cheap enough not to dominate the operations timed and
+ * with no shared state between threads, unlike rand()
+ */
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static size_t entry_size(enum size_dist dist, uint64_t *state)
+{
+    uint64_t r = next_random(state);
+
+    switch (dist) {
+    case SIZE_FIXED:
+        return 64;
+    case SIZE_UNIFORM:
+        return 1 + r % 256;
+    case SIZE_SKEWED:
+    default:
+        return (r >> 32) % 10 ? 1 + r % 32 : 1 + r % PAYLOAD_LEN;
+    }
+}
+
+static void add_random_entry(struct aesd_circular_buffer *buffer, enum size_dist dist,
+                             uint64_t *state)
+{
+    struct aesd_buffer_entry entry = {
+        .buffptr = g_payload,
+        .size = entry_size(dist, state),
+    };
+    aesd_circular_buffer_add_entry(buffer, &entry);
+}
+
+/**
+ * @brief Set up a buffer of @param depth entries, filled past capacity so
+ * out_offs is not at index 0 and lookups wrap around the entry array.
+ * @return the storage to free, or NULL when out of memory
+ */
+static struct aesd_buffer_entry *fill_buffer(struct aesd_circular_buffer *buffer, uint32_t depth,
+                                             enum size_dist dist, uint64_t *state)
+{
+    struct aesd_buffer_entry *storage = calloc(depth, sizeof(*storage));
+
+    if (!storage) {
+        perror("calloc");
+        return NULL;
+    }
+    aesd_circular_buffer_init_storage(buffer, storage, depth);
+    for (uint32_t i = 0; i < depth + depth / 2; i++)
+        add_random_entry(buffer, dist, state);
+    return storage;
+}
+
+static void print_header(void)
+{
+    switch (g_format) {
+    case FORMAT_TEXT:
+        printf("%-10s %8s %-10s %7s %12s %10s %10s\n",
+               "benchmark", "depth", "sizes", "threads", "ops", "ns/op", "Mops/s");
+        break;
+    case FORMAT_CSV:
+        printf("benchmark,depth,sizes,threads,ops,ns_per_op,mops_per_s\n");
+        break;
+    case FORMAT_JSON:
+        printf("[");
+        break;
+    }
+}
+
+static void print_footer(void)
+{
+    if (g_format == FORMAT_JSON)
+        printf("%s]\n", g_rows ? "\n" : "");
+}
+
+/**
+ * @brief Print one result: @param ops operations took @param elapsed_ns of
+ * wall time in total across @param threads threads.
+ */
+static void print_row(const char *benchmark, uint32_t depth, enum size_dist dist,
+                      unsigned int threads, unsigned long ops, uint64_t elapsed_ns)
+{
+    double ns_per_op = (double)elapsed_ns / ops;
+    double mops = ops * 1e3 / elapsed_ns;
+
+    switch (g_format) {
+    case FORMAT_TEXT:
+        printf("%-10s %8u %-10s %7u %12lu %10.1f %10.2f\n",
+               benchmark, depth, size_dist_names[dist], threads, ops, ns_per_op, mops);
+        break;
+    case FORMAT_CSV:
+        printf("%s,%u,%s,%u,%lu,%.2f,%.3f\n",
+               benchmark, depth, size_dist_names[dist], threads, ops, ns_per_op, mops);
+        break;
+    case FORMAT_JSON:
+        printf("%s\n  {\"benchmark\": \"%s\", \"depth\": %u, \"sizes\": \"%s\", \"threads\": %u, "
+               "\"ops\": %lu, \"ns_per_op\": %.2f, \"mops_per_s\": %.3f}",
+               g_rows ? "," : "", benchmark, depth, size_dist_names[dist], threads, ops,
+               ns_per_op, mops);
+        break;
+    }
+    g_rows++;
+    fflush(stdout);
+}
+
+static int bench_add(uint32_t depth, enum size_dist dist)
+{
+    struct aesd_circular_buffer buffer;
+    uint64_t state = 0x9e3779b97f4a7c15ull ^ depth;
+    struct aesd_buffer_entry *storage = fill_buffer(&buffer, depth, dist, &state);
+    struct aesd_buffer_entry entries[BATCH];
+    unsigned long ops = 0;
+    uint64_t start, elapsed;
+
+    if (!storage)
+        return -1;
+    /* Sizes are drawn up front so only add_entry() is timed */
+    for (int i = 0; i < BATCH; i++) {
+        entries[i].buffptr = g_payload;
+        entries[i].size = entry_size(dist, &state);
+    }
+    start = now_ns();
+    do {
+        for (int i = 0; i < BATCH; i++)
+            aesd_circular_buffer_add_entry(&buffer, &entries[i]);
+        ops += BATCH;
+        elapsed = now_ns() - start;
+    } while (elapsed < g_runtime_ns);
+
+    print_row("add", depth, dist, 1, ops, elapsed);
+    free(storage);
+    return 0;
+}
+
+static int bench_find(uint32_t depth, enum size_dist dist, size_t *sink)
+{
+    struct aesd_circular_buffer buffer;
+    uint64_t state = 0x2545f4914f6cdd1dull ^ depth;
+    struct aesd_buffer_entry *storage = fill_buffer(&buffer, depth, dist, &state);
+    unsigned long ops = 0;
+    uint64_t start, elapsed;
+
+    if (!storage)
+        return -1;
+    start = now_ns();
+    do {
+        for (int i = 0; i < BATCH; i++) {
+            size_t entry_offset;
+            size_t fpos = next_random(&state) % buffer.total_size;
+            struct aesd_buffer_entry *entry =
+                aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, fpos, &entry_offset);
+            *sink += entry ? entry_offset : 1;
+        }
+        ops += BATCH;
+        elapsed = now_ns() - start;
+    } while (elapsed < g_runtime_ns);
+
+    print_row("find", depth, dist, 1, ops, elapsed);
+    free(storage);
+    return 0;
+}
+
+/**
+ * State shared by the threads of one contended run
+ */
+struct contended_run {
+    struct aesd_circular_buffer buffer;
+    pthread_mutex_t lock;
+    atomic_bool stop;
+    atomic_ulong ops;
+    atomic_size_t sink;
+};
+
+struct contended_thread {
+    struct contended_run *run;
+    uint64_t seed;
+};
+
+static void *contended_thread(void *arg)
+{
+    struct contended_thread *thread = arg;
+    struct contended_run *run = thread->run;
+    uint64_t state = thread->seed;
+    unsigned long ops = 0;
+    size_t sink = 0;
+
+    while (!atomic_load_explicit(&run->stop, memory_order_relaxed)) {
+        for (int i = 0; i < BATCH; i++) {
+            size_t entry_offset;
+
+            pthread_mutex_lock(&run->lock);
+            if (i % ADDS_EVERY == 0) {
+                add_random_entry(&run->buffer, SIZE_UNIFORM, &state);
+            } else {
+                size_t fpos = next_random(&state) % run->buffer.total_size;
+                struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(
+                    &run->buffer, fpos, &entry_offset);
+                sink += entry ? entry_offset : 1;
+            }
+            pthread_mutex_unlock(&run->lock);
+        }
+        ops += BATCH;
+    }
+    atomic_fetch_add(&run->ops, ops);
+    atomic_fetch_add(&run->sink, sink);
+    return NULL;
+}
+
+static int bench_contended(unsigned int threads, size_t *sink)
+{
+    struct contended_run run;
+    struct contended_thread args[threads];
+    pthread_t tids[threads];
+    uint64_t state = 0xda942042e4dd58b5ull;
+    struct aesd_buffer_entry *storage = fill_buffer(&run.buffer, CONTENDED_DEPTH, SIZE_UNIFORM,
+                                                    &state);
+    uint64_t start, elapsed;
+    unsigned int started;
+
+    if (!storage)
+        return -1;
+    pthread_mutex_init(&run.lock, NULL);
+    atomic_init(&run.stop, false);
+    atomic_init(&run.ops, 0);
+    atomic_init(&run.sink, 0);
+
+    start = now_ns();
+    for (started = 0; started < threads; started++) {
+        args[started].run = &run;
+        args[started].seed = next_random(&state);
+        if (pthread_create(&tids[started], NULL, contended_thread, &args[started]) != 0) {
+            perror("pthread_create");
+            break;
+        }
+    }
+    usleep(g_runtime_ns / 1000);
+    atomic_store(&run.stop, true);
+    for (unsigned int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    elapsed = now_ns() - start;
+
+    if (started == threads)
+        print_row("contended", CONTENDED_DEPTH, SIZE_UNIFORM, threads, atomic_load(&run.ops),
+                  elapsed);
+    *sink += atomic_load(&run.sink);
+    pthread_mutex_destroy(&run.lock);
+    free(storage);
+    return started == threads ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+    static const uint32_t depths[] = { 10, 100, 1000, 10000, AESDCHAR_MAX_ENTRIES_LIMIT };
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int max_threads = cpus > 0 ? cpus : 1;
+    size_t sink = 0;
+    int result = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:s:t:")) != -1) {
+        switch (opt) {
+        case 'f':
+            if (strcmp(optarg, "text") == 0) {
+                g_format = FORMAT_TEXT;
+            } else if (strcmp(optarg, "csv") == 0) {
+                g_format = FORMAT_CSV;
+            } else if (strcmp(optarg, "json") == 0) {
+                g_format = FORMAT_JSON;
+            } else {
+                fprintf(stderr, "Unknown format %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 's':
+            g_runtime_ns = atof(optarg) * 1e9;
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-f text|csv|json] [-s seconds] [-t max_threads]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (g_runtime_ns == 0 || max_threads == 0) {
+        fprintf(stderr, "Measurement time and thread count must be positive\n");
+        return 1;
+    }
+
+    print_header();
+    for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]) && result == 0; d++)
+        result = bench_add(depths[d], SIZE_UNIFORM);
+    for (int dist = 0; dist < SIZE_DIST_COUNT; dist++) {
+        for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]) && result == 0; d++)
+            result = bench_find(depths[d], dist, &sink);
+    }
+    for (unsigned int threads = 1; threads <= max_threads && result == 0; threads *= 2)
+        result = bench_contended(threads, &sink);
+    print_footer();
+
+    /* sink keeps the lookups from being optimized out */
+    return result != 0 || sink == 0;
+}
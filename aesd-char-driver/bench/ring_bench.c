@@ -0,0 +1,233 @@
+/**
+ * @file ring_bench.c
+ * @brief Producer to consumer handoff throughput of the aesd ring variants
+ *
+ * Moves a fixed number of line descriptors from 1, 2, 4, ... producer
+ * threads to one consumer thread, as connection threads hand completed
+ * lines to a writer thread, through:
+ * - mutex: an AESD_RING_DEFINE() ring guarded by a pthread mutex
+ * - spsc: AESD_SPSC_RING_DEFINE(), single producer runs only
+ * - mpsc: AESD_MPSC_RING_DEFINE()
+ * Every side yields the CPU when the ring is full or empty, so the numbers
+ * compare the synchronization cost rather than a waiting strategy.
+ *
+ * Build with the ring_bench CMake target, or from aesd-char-driver/:
+ *     gcc -O2 -Wall -pthread -I. bench/ring_bench.c -o ring_bench
+ *     ./ring_bench [-n items] [-p max_producers]
+ *
+ * @author Parth Varsani
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "aesd-ring.h"
+#include "aesd-ring-lockfree.h"
+
+#define RING_ORDER 10
+
+/* What a connection thread would hand over for one completed line */
+struct line_desc {
+    const char *data;
+    size_t len;
+};
+
+AESD_RING_DEFINE(line_ring, struct line_desc, RING_ORDER)
+AESD_SPSC_RING_DEFINE(line_spsc, struct line_desc, RING_ORDER)
+AESD_MPSC_RING_DEFINE(line_mpsc, struct line_desc, RING_ORDER)
+
+struct locked_ring {
+    pthread_mutex_t lock;
+    struct line_ring ring;
+};
+
+enum ring_kind {
+    RING_MUTEX,
+    RING_SPSC,
+    RING_MPSC,
+};
+
+static const char *const ring_names[] = {
+    [RING_MUTEX] = "mutex",
+    [RING_SPSC] = "spsc",
+    [RING_MPSC] = "mpsc",
+};
+
+struct bench_run {
+    enum ring_kind kind;
+    void *ring;
+    unsigned long items_per_producer;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool ring_push(struct bench_run *run, const struct line_desc *line)
+{
+    struct locked_ring *locked;
+    bool pushed;
+
+    switch (run->kind) {
+    case RING_MUTEX:
+        locked = run->ring;
+        pthread_mutex_lock(&locked->lock);
+        pushed = line_ring_push(&locked->ring, line);
+        pthread_mutex_unlock(&locked->lock);
+        return pushed;
+    case RING_SPSC:
+        return line_spsc_push(run->ring, line);
+    case RING_MPSC:
+    default:
+        return line_mpsc_push(run->ring, line);
+    }
+}
+
+static bool ring_pop(struct bench_run *run, struct line_desc *line)
+{
+    struct locked_ring *locked;
+    bool popped;
+
+    switch (run->kind) {
+    case RING_MUTEX:
+        locked = run->ring;
+        pthread_mutex_lock(&locked->lock);
+        popped = line_ring_pop(&locked->ring, line);
+        pthread_mutex_unlock(&locked->lock);
+        return popped;
+    case RING_SPSC:
+        return line_spsc_pop(run->ring, line);
+    case RING_MPSC:
+    default:
+        return line_mpsc_pop(run->ring, line);
+    }
+}
+
+static void *producer_thread(void *arg)
+{
+    static const char line[] = "benchmark line\n";
+    struct bench_run *run = arg;
+
+    for (unsigned long i = 0; i < run->items_per_producer; i++) {
+        struct line_desc desc = { line, i % sizeof(line) };
+        while (!ring_push(run, &desc))
+            sched_yield();
+    }
+    return NULL;
+}
+
+/**
+ * @brief Time @param producers threads handing over @param items in total.
+ * @return the consumer's checksum, -1 if a thread could not be started
+ */
+static long run_bench(enum ring_kind kind, unsigned int producers, unsigned long items)
+{
+    struct bench_run run = {
+        .kind = kind,
+        .items_per_producer = items / producers,
+    };
+    pthread_t threads[producers];
+    struct line_desc line;
+    unsigned long total = run.items_per_producer * producers;
+    unsigned long received = 0;
+    unsigned int started;
+    uint64_t start, elapsed;
+    long checksum = 0;
+
+    switch (kind) {
+    case RING_MUTEX:
+        run.ring = malloc(sizeof(struct locked_ring));
+        if (run.ring) {
+            pthread_mutex_init(&((struct locked_ring *)run.ring)->lock, NULL);
+            line_ring_init(&((struct locked_ring *)run.ring)->ring);
+        }
+        break;
+    case RING_SPSC:
+        run.ring = aligned_alloc(AESD_RING_CACHE_LINE, sizeof(struct line_spsc));
+        if (run.ring)
+            line_spsc_init(run.ring);
+        break;
+    case RING_MPSC:
+        run.ring = aligned_alloc(AESD_RING_CACHE_LINE, sizeof(struct line_mpsc));
+        if (run.ring)
+            line_mpsc_init(run.ring);
+        break;
+    }
+    if (!run.ring) {
+        perror("malloc");
+        return -1;
+    }
+
+    start = now_ns();
+    for (started = 0; started < producers; started++) {
+        if (pthread_create(&threads[started], NULL, producer_thread, &run) != 0) {
+            perror("pthread_create");
+            break;
+        }
+    }
+    if (started < producers)
+        total = run.items_per_producer * started;
+    while (received < total) {
+        if (!ring_pop(&run, &line)) {
+            sched_yield();
+            continue;
+        }
+        checksum += line.len;
+        received++;
+    }
+    for (unsigned int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    elapsed = now_ns() - start;
+
+    if (started == producers)
+        printf("%-6s %9u %12lu %10.2f\n", ring_names[kind], producers, total,
+               total * 1e3 / elapsed);
+    if (kind == RING_MUTEX)
+        pthread_mutex_destroy(&((struct locked_ring *)run.ring)->lock);
+    free(run.ring);
+    return started == producers ? checksum : -1;
+}
+
+int main(int argc, char **argv)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int max_producers = cpus > 1 ? cpus - 1 : 1;
+    unsigned long items = 10000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:p:")) != -1) {
+        switch (opt) {
+        case 'n':
+            items = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            max_producers = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n items] [-p max_producers]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (items == 0 || max_producers == 0) {
+        fprintf(stderr, "Item and producer counts must be positive\n");
+        return 1;
+    }
+
+    printf("%-6s %9s %12s %10s\n", "ring", "producers", "items", "Mitems/s");
+    for (unsigned int producers = 1; producers <= max_producers; producers *= 2) {
+        if (run_bench(RING_MUTEX, producers, items) < 0 ||
+            (producers == 1 && run_bench(RING_SPSC, producers, items) < 0) ||
+            run_bench(RING_MPSC, producers, items) < 0)
+            return 1;
+    }
+    return 0;
+}
@@ -20,6 +20,19 @@
 #include <linux/fs.h> 		// file_operations
 #include <linux/uaccess.h> 	// copy_from_user
 #include <linux/slab.h> 	// kmalloc & kfree
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/uio.h> 	// iov_iter
+#include <linux/splice.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/version.h>
+#include <linux/percpu.h>
+#include <linux/list_sort.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
 
@@ -27,136 +40,749 @@
 int aesd_major =   0; 		// use dynamic major
 int aesd_minor =   0;
 
+static unsigned int max_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(max_entries, uint, 0444);
+MODULE_PARM_DESC(max_entries, "Number of write commands kept (1-65536, default 10)");
+
+static unsigned long max_bytes;
+module_param(max_bytes, ulong, 0444);
+MODULE_PARM_DESC(max_bytes, "Total bytes kept across write commands (0 for no limit)");
+
+static unsigned long ring_size = 4 * 1024 * 1024;
+module_param(ring_size, ulong, 0444);
+MODULE_PARM_DESC(ring_size, "Bytes of page-backed command storage, rounded up to a power of two (default 4 MiB)");
+
+static unsigned int nr_devices = 1;
+module_param(nr_devices, uint, 0444);
+MODULE_PARM_DESC(nr_devices, "Number of aesdchar minors, each with its own buffer (default 1)");
+
+static bool percpu_staging;
+module_param(percpu_staging, bool, 0444);
+MODULE_PARM_DESC(percpu_staging, "Stage completed commands per CPU and store them in batches (default off)");
+
 MODULE_AUTHOR("Parth Varsani"); /** TODO: fill in your name **/
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+struct aesd_dev *aesd_devices;  	// nr_devices entries, one per minor
+
+/* Staging chunks come and go with partial writes, keep them in their own cache */
+static struct kmem_cache *aesd_chunk_cache;
+
+/* Bytes of a staged command held by one page-sized chunk */
+#define AESD_CHUNK_DATA_LEN (PAGE_SIZE - offsetof(struct aesd_chunk, data))
+
+static void aesd_file_store(struct aesd_dev *dev, struct aesd_file *file, size_t size);
+
+/* Root of the per device debugfs directories */
+static struct dentry *aesd_debugfs_root;
+
+static void aesd_hist_add(u64 *hist, u64 ns)
+{
+    hist[min_t(unsigned int, ilog2(ns | 1), AESD_HIST_BUCKETS - 1)]++;
+}
+
+/**
+ * Take dev->lock.  A contended acquisition is counted and its wait time
+ * added to lock_wait_ns and the wait histogram.  Every dev->lock holder goes
+ * through aesd_lock() and aesd_unlock() so hold times are complete.
+ */
+static void aesd_lock(struct aesd_dev *dev)
+{
+    u64 start, now;
+
+    if (mutex_trylock(&dev->lock)) {
+        dev->lockstat.acquired_ns = ktime_get_ns();
+        return;
+    }
+    start = ktime_get_ns();
+    mutex_lock(&dev->lock);
+    now = ktime_get_ns();
+    atomic64_add(now - start, &dev->lock_wait_ns);
+    dev->lockstat.contended++;
+    aesd_hist_add(dev->lockstat.wait_hist, now - start);
+    dev->lockstat.acquired_ns = now;
+}
+
+/**
+ * Release dev->lock, recording how long it was held, and let writers waiting
+ * for it in aesd_stage_commands() try again.
+ */
+static void aesd_unlock(struct aesd_dev *dev)
+{
+    aesd_hist_add(dev->lockstat.hold_hist, ktime_get_ns() - dev->lockstat.acquired_ns);
+    mutex_unlock(&dev->lock);
+    if (wq_has_sleeper(&dev->stageq))
+        wake_up(&dev->stageq);
+}
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
-    PDEBUG("open");
-    filp->private_data = &aesd_device;
+    struct aesd_dev *dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    struct aesd_file *file;
+
+    PDEBUG("open minor %u", iminor(inode));
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (!file)
+        return -ENOMEM;
+    atomic_long_inc(&dev->allocations);
+    file->dev = dev;
+    mutex_init(&file->lock);
+    INIT_LIST_HEAD(&file->chunks);
+    filp->private_data = file;
     return 0;
 }
 
+/**
+ * A partial command still staged when the file is closed is handed to the
+ * device, where the next completed command from any file finishes it, as
+ * with "echo -n" followed by "echo".
+ */
 int aesd_release(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_chunk *chunk, *next;
+
     PDEBUG("release");
+    if (file->partial_size) {
+        aesd_lock(dev);
+        aesd_file_store(dev, file, file->partial_size);
+        aesd_unlock(dev);
+    }
+    list_for_each_entry_safe(chunk, next, &file->chunks, list)
+        kmem_cache_free(aesd_chunk_cache, chunk);
+    mutex_destroy(&file->lock);
+    kfree(file);
     filp->private_data = NULL;
     return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+/*
+ * Command bytes live in a page-backed ring at their stream position, the
+ * entries only describe where each command starts and ends.  The ring pages
+ * are mapped twice in a row, so any ring_size bytes from any position are
+ * contiguous in dev->ring, and the same pages back mmap() of the device.
+ *
+ * Readers do not take dev->lock.  Writers change the buffer under dev->lock
+ * inside a dev->seq write section, and readers retry whatever they read from
+ * the buffer until dev->seq shows no writer got in between.  Entry arrays a
+ * writer drops are freed only after an RCU grace period.  Before overwriting
+ * ring bytes a writer raises dev->reclaim past their old stream positions,
+ * so a reader that finds reclaim above the bytes it copied discards them.
+ */
+
+static size_t aesd_ring_offset(struct aesd_dev *dev, size_t stream_pos)
 {
-    struct aesd_dev *dev = filp->private_data;
-    struct aesd_buffer_entry *entry = NULL;
-    size_t entry_offset = 0;
-    size_t bytes_to_copy = 0;
-    ssize_t retval = 0;
+    return stream_pos & (dev->ring_size - 1);
+}
 
-    if (!dev || !buf || !f_pos) {
+/**
+ * Copy the buffer state to the header page read by mmap() users.  Caller must
+ * be inside a dev->seq write section.
+ */
+static void aesd_ring_publish(struct aesd_dev *dev)
+{
+    struct aesd_ring_header *header = dev->header;
+
+    WRITE_ONCE(header->seq, header->seq + 1);
+    smp_wmb();
+    WRITE_ONCE(header->head, dev->buffer.stream_end - dev->buffer.total_size);
+    WRITE_ONCE(header->tail, dev->buffer.stream_end);
+    WRITE_ONCE(header->reclaim, dev->reclaim);
+    smp_wmb();
+    WRITE_ONCE(header->seq, header->seq + 1);
+}
+
+/**
+ * Copy the buffer indices for a lockless reader.  The copy is consistent: its
+ * entry array is exactly capacity entries long and stays allocated until the
+ * caller leaves its RCU read-side section, so lookups in the copy stay in
+ * bounds even while a writer changes the entries.  Their result only counts if
+ * read_seqcount_retry() with the returned sequence passes afterwards.
+ */
+static unsigned int aesd_buffer_snapshot(struct aesd_dev *dev,
+                                         struct aesd_circular_buffer *snapshot)
+{
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        snapshot->entry = dev->buffer.entry;
+        snapshot->capacity = dev->buffer.capacity;
+        snapshot->in_offs = dev->buffer.in_offs;
+        snapshot->out_offs = dev->buffer.out_offs;
+        snapshot->full = dev->buffer.full;
+        snapshot->total_size = dev->buffer.total_size;
+        snapshot->stream_end = dev->buffer.stream_end;
+        snapshot->seq_end = dev->buffer.seq_end;
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    return seq;
+}
+
+/**
+ * Read the stream positions of the oldest stored byte and of the end of the
+ * newest command without taking dev->lock.
+ */
+static void aesd_stream_bounds(struct aesd_dev *dev, size_t *head, size_t *tail)
+{
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        *tail = dev->buffer.stream_end;
+        *head = *tail - dev->buffer.total_size;
+    } while (read_seqcount_retry(&dev->seq, seq));
+}
+
+/**
+ * Handles read() as well as splice_read, which lets aesdsocket splice() stored
+ * commands to a socket without a userspace copy.  Commands are contiguous in
+ * the ring, so everything from the file position to the end of the newest
+ * command is copied at once, without taking a lock.
+ *
+ * In tail mode (AESDCHAR_IOCSETTAIL) the file follows its own stream position
+ * instead, skipping commands evicted before it read them, and a read at the
+ * end waits for the next command unless the file is non-blocking.
+ */
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct aesd_file *file = iocb->ki_filp->private_data;
+    struct aesd_dev *dev;
+    size_t head, tail, start, len, copied;
+
+    if (!file)
         return -EINVAL;
+    dev = file->dev;
+
+    for (;;) {
+        aesd_stream_bounds(dev, &head, &tail);
+
+        if (file->tail) {
+            start = max(file->stream_pos, head);
+        } else if ((size_t)iocb->ki_pos < tail - head) {
+            start = head + iocb->ki_pos;
+        } else {
+            return 0;  // EOF reached
+        }
+
+        if (start >= tail) {
+            if ((iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT))
+                return -EAGAIN;
+            if (wait_event_interruptible(dev->readq, READ_ONCE(dev->buffer.stream_end) > start))
+                return -ERESTARTSYS;
+            continue;
+        }
+
+        len = min(iov_iter_count(to), tail - start);
+        copied = copy_to_iter(dev->ring + aesd_ring_offset(dev, start), len, to);
+
+        // Keep the copy only if no writer reused those bytes meanwhile
+        smp_rmb();
+        if (READ_ONCE(dev->reclaim) <= start)
+            break;
+        iov_iter_revert(to, copied);
     }
 
-    if (mutex_lock_interruptible(&dev->lock)) {
-        return -ERESTARTSYS;
+    if (copied == 0 && len > 0)
+        return -EFAULT;
+
+    if (file->tail)
+        file->stream_pos = start + copied;
+    iocb->ki_pos = start + copied - head;
+    this_cpu_inc(dev->counters->reads);
+    this_cpu_add(dev->counters->bytes_out, copied);
+    return copied;
+}
+
+/**
+ * Reports EPOLLIN while there is data past the file position, or past the
+ * stream position in tail mode, so tailing readers can sleep in poll/epoll.
+ * Writes never wait for readers, so EPOLLOUT is always set.
+ */
+static __poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+    size_t head, tail;
+
+    poll_wait(filp, &dev->readq, wait);
+
+    aesd_stream_bounds(dev, &head, &tail);
+    if (file->tail ? tail > file->stream_pos : (size_t)filp->f_pos < tail - head)
+        mask |= EPOLLIN | EPOLLRDNORM;
+    return mask;
+}
+
+/**
+ * Drop the oldest command, its bytes are left in the ring to be overwritten.
+ * Caller must hold dev->lock inside a dev->seq write section.
+ * @return false if no command was stored
+ */
+static bool aesd_evict_oldest(struct aesd_dev *dev)
+{
+    struct aesd_buffer_entry removed;
+
+    if (!aesd_circular_buffer_remove_oldest(&dev->buffer, &removed))
+        return false;
+    dev->stats.evictions++;
+    return true;
+}
+
+/**
+ * Free the oldest commands until @incoming more bytes fit in the byte budget,
+ * if one is set.  Caller must hold dev->lock inside a dev->seq write section.
+ */
+static void aesd_evict_to_budget(struct aesd_dev *dev, size_t incoming)
+{
+    if (!dev->max_bytes)
+        return;
+
+    while (dev->buffer.total_size + incoming > dev->max_bytes && aesd_evict_oldest(dev))
+        ;
+}
+
+/**
+ * Make room in the ring for @count bytes after the partial command, evicting
+ * the oldest commands whose bytes they would overwrite.  Caller must hold
+ * dev->lock, and @count plus dev->partial_size must not exceed the ring.
+ */
+static void aesd_ring_reserve(struct aesd_dev *dev, size_t count)
+{
+    size_t end = dev->buffer.stream_end + dev->partial_size + count;
+
+    write_seqcount_begin(&dev->seq);
+
+    while (dev->buffer.total_size + dev->partial_size + count > dev->ring_size &&
+           aesd_evict_oldest(dev))
+        ;
+    if (end > dev->ring_size)
+        WRITE_ONCE(dev->reclaim, end - dev->ring_size);
+    aesd_ring_publish(dev);
+
+    write_seqcount_end(&dev->seq);
+
+    // Readers must see the new reclaim position before the bytes change
+    smp_wmb();
+}
+
+/**
+ * Store the partial command plus the next @size bytes, already in the ring,
+ * as a command, evicting the entries it displaces under the entry count and
+ * byte limits.  Caller must hold dev->lock inside a dev->seq write section.
+ */
+static void aesd_add_entry(struct aesd_dev *dev, size_t size)
+{
+    struct aesd_buffer_entry new_entry = {
+        .buffptr = dev->ring + aesd_ring_offset(dev, dev->buffer.stream_end),
+        .size = dev->partial_size + size,
+    };
+
+    dev->partial_size = 0;
+    aesd_evict_to_budget(dev, new_entry.size);
+    if (dev->buffer.full)
+        dev->stats.evictions++;
+    aesd_circular_buffer_add_entry(&dev->buffer, &new_entry);
+    dev->stats.commands++;
+}
+
+/**
+ * Append @len bytes to the ring behind the device's partial command, copied
+ * from @buf or, if @buf is NULL, straight from @from.  Every newline
+ * completes a command, the bytes after the last one extend the device's
+ * partial command, and a partial command that fills the whole ring is stored
+ * unterminated.  Readers are not woken.  Caller must hold dev->lock.
+ * @return bytes appended, fewer than @len only if copying from @from faulted
+ */
+static size_t aesd_ring_append(struct aesd_dev *dev, const char *buf, struct iov_iter *from,
+                               size_t len)
+{
+    size_t appended = 0;
+
+    while (appended < len) {
+        size_t count = min(len - appended, dev->ring_size - dev->partial_size);
+        const char *newline, *pos, *end;
+        char *data;
+
+        aesd_ring_reserve(dev, count);
+        data = dev->ring + aesd_ring_offset(dev, dev->buffer.stream_end + dev->partial_size);
+        if (buf)
+            memcpy(data, buf + appended, count);
+        else
+            count = copy_from_iter(data, count, from);
+        if (count == 0)
+            break;
+
+        write_seqcount_begin(&dev->seq);
+
+        pos = data;
+        end = data + count;
+        while ((newline = memchr(pos, '\n', end - pos)) != NULL) {
+            aesd_add_entry(dev, newline + 1 - pos);
+            pos = newline + 1;
+        }
+        dev->partial_size += end - pos;
+        if (dev->partial_size == dev->ring_size)
+            aesd_add_entry(dev, 0);
+        aesd_ring_publish(dev);
+
+        write_seqcount_end(&dev->seq);
+
+        appended += count;
     }
+    return appended;
+}
 
-    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer, *f_pos, &entry_offset);
-    if (!entry) {
-        retval = 0;  // EOF reached
-        goto out;
+/**
+ * Wake readers waiting for new commands if any was stored since the newest
+ * command ended at @stream_end.
+ */
+static void aesd_wake_readers(struct aesd_dev *dev, size_t stream_end)
+{
+    if (dev->buffer.stream_end != stream_end)
+        wake_up_interruptible_poll(&dev->readq, EPOLLIN | EPOLLRDNORM);
+}
+
+/*
+ * A file's incomplete command is staged in a list of page-sized chunks.
+ * Writes append in place to the last chunk and add a chunk when it is full,
+ * so staged bytes are never re-copied while the command grows; they are
+ * copied once more only when the command completes, into the ring.  The
+ * staging is guarded by file->lock, which also serializes writers sharing
+ * one struct file, e.g. concurrent io_uring writes on the same descriptor.
+ */
+
+static struct aesd_chunk *aesd_chunk_alloc(struct aesd_dev *dev)
+{
+    struct aesd_chunk *chunk = kmem_cache_alloc(aesd_chunk_cache, GFP_KERNEL);
+
+    if (!chunk)
+        return NULL;
+    atomic_long_inc(&dev->allocations);
+    this_cpu_inc(dev->counters->partial_chunks);
+    chunk->start = chunk->len = 0;
+    return chunk;
+}
+
+/**
+ * Stage up to @count bytes from @from after the file's staged bytes.
+ * Caller must hold file->lock.
+ * @return bytes staged, or -ENOMEM or -EFAULT if none could be
+ */
+static ssize_t aesd_file_stage(struct aesd_file *file, struct iov_iter *from, size_t count)
+{
+    size_t staged = 0;
+
+    while (staged < count) {
+        struct aesd_chunk *chunk = NULL;
+        size_t copied;
+
+        if (!list_empty(&file->chunks))
+            chunk = list_last_entry(&file->chunks, struct aesd_chunk, list);
+        if (!chunk || chunk->len == AESD_CHUNK_DATA_LEN) {
+            chunk = aesd_chunk_alloc(file->dev);
+            if (!chunk)
+                return staged ? staged : -ENOMEM;
+            list_add_tail(&chunk->list, &file->chunks);
+        }
+        copied = copy_from_iter(chunk->data + chunk->len,
+                                min(count - staged, AESD_CHUNK_DATA_LEN - chunk->len), from);
+        if (copied == 0)
+            return staged ? staged : -EFAULT;
+        chunk->len += copied;
+        file->partial_size += copied;
+        staged += copied;
     }
+    return staged;
+}
 
-    bytes_to_copy = min(count, entry->size - entry_offset);
+/**
+ * Drop the staged bytes from @size on, e.g. those of a write that failed.
+ * Caller must hold file->lock.
+ */
+static void aesd_file_unstage(struct aesd_file *file, size_t size)
+{
+    while (file->partial_size > size) {
+        struct aesd_chunk *chunk = list_last_entry(&file->chunks, struct aesd_chunk, list);
+        size_t drop = min(file->partial_size - size, chunk->len - chunk->start);
 
-    if (copy_to_user(buf, entry->buffptr + entry_offset, bytes_to_copy)) {
-        retval = -EFAULT;
-        goto out;
+        chunk->len -= drop;
+        file->partial_size -= drop;
+        if (chunk->len == chunk->start) {
+            chunk->start = chunk->len = 0;
+            if (!list_is_singular(&file->chunks)) {
+                list_del(&chunk->list);
+                kmem_cache_free(aesd_chunk_cache, chunk);
+            }
+        }
     }
+}
+
+/**
+ * Find the end of the last newline among the staged bytes from @from on.
+ * Caller must hold file->lock.
+ * @return staged bytes up to and including that newline, 0 if there is none
+ */
+static size_t aesd_file_complete(struct aesd_file *file, size_t from)
+{
+    struct aesd_chunk *chunk;
+    size_t pos = 0, complete = 0;
 
-    *f_pos += bytes_to_copy;
-    retval = bytes_to_copy;
+    list_for_each_entry(chunk, &file->chunks, list) {
+        size_t len = chunk->len - chunk->start;
 
-out:
-    mutex_unlock(&dev->lock);
-    return retval;
+        if (pos + len > from) {
+            const char *data = chunk->data + chunk->start;
+            const char *newline = data + (from > pos ? from - pos : 0);
+
+            while ((newline = memchr(newline, '\n', data + len - newline)) != NULL)
+                complete = pos + (++newline - data);
+        }
+        pos += len;
+    }
+    return complete;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+/**
+ * Append the first @size staged bytes of @file to the ring and drop them
+ * from the staging, keeping one empty chunk for the next partial command.
+ * Caller must hold dev->lock, and file->lock or be storing on behalf of
+ * its holder.
+ */
+static void aesd_file_store(struct aesd_dev *dev, struct aesd_file *file, size_t size)
 {
-    struct aesd_dev *dev = filp->private_data;
-    struct aesd_buffer_entry new_entry;
-    char *new_buf;
-    ssize_t retval = count;
-    bool newline_found = false;
-    size_t i;
+    struct aesd_chunk *chunk, *next;
 
-    PDEBUG("write %zu bytes with offset %lld", count, *f_pos);
+    list_for_each_entry_safe(chunk, next, &file->chunks, list) {
+        size_t len = min(size, chunk->len - chunk->start);
 
-    /* Allocate memory for incoming data */
-    new_buf = kmalloc(count + dev->partial_size, GFP_KERNEL);
-    if (!new_buf)
-        return -ENOMEM;
+        if (len == 0)
+            break;
+        aesd_ring_append(dev, chunk->data + chunk->start, NULL, len);
+        chunk->start += len;
+        file->partial_size -= len;
+        size -= len;
+        if (chunk->start == chunk->len) {
+            chunk->start = chunk->len = 0;
+            if (!list_is_singular(&file->chunks)) {
+                list_del(&chunk->list);
+                kmem_cache_free(aesd_chunk_cache, chunk);
+            }
+        }
+    }
+}
 
-    /* Copy previous partial data if exists */
-    if (dev->partial_write) {
-        memcpy(new_buf, dev->partial_write, dev->partial_size);
-        kfree(dev->partial_write);
-        dev->partial_write = NULL;
+static int aesd_staged_cmp(void *priv, const struct list_head *a, const struct list_head *b)
+{
+    const struct aesd_staged *sa = list_entry(a, struct aesd_staged, list);
+    const struct aesd_staged *sb = list_entry(b, struct aesd_staged, list);
+
+    return sa->ticket > sb->ticket;
+}
+
+/**
+ * Store the commands staged on every CPU in ticket order, so the sequence
+ * numbers they get follow the order they were staged in, and mark them
+ * stored.  Caller must hold dev->lock.
+ */
+static void aesd_combine(struct aesd_dev *dev)
+{
+    struct aesd_staged *staged, *next;
+    size_t stream_end = dev->buffer.stream_end;
+    LIST_HEAD(batch);
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct aesd_stage *stage = per_cpu_ptr(dev->stage, cpu);
+
+        spin_lock(&stage->lock);
+        list_for_each_entry(staged, &stage->list, list)
+            staged->taken = true;
+        list_splice_tail_init(&stage->list, &batch);
+        spin_unlock(&stage->lock);
     }
+    // Each CPU's run is already in ticket order, the merge sort only interleaves them
+    list_sort(NULL, &batch, aesd_staged_cmp);
 
-    /* Copy user data */
-    if (copy_from_user(new_buf + dev->partial_size, buf, count)) {
-        kfree(new_buf);
-        return -EFAULT;
+    list_for_each_entry_safe(staged, next, &batch, list) {
+        // The writer sleeps holding file->lock until stored is set
+        aesd_file_store(dev, staged->file, staged->len);
+        list_del(&staged->list);
+        // The writer may return and reuse the entry as soon as it sees this
+        smp_store_release(&staged->stored, true);
     }
 
-    /* Check if newline is present */
-    for (i = 0; i < count; i++) {
-        if (new_buf[dev->partial_size + i] == '\n') {
-            newline_found = true;
-            break;
+    aesd_wake_readers(dev, stream_end);
+}
+
+/**
+ * Flat combining write path used with percpu_staging.  The first @len
+ * staged bytes of @file, completed commands, are queued on this CPU's
+ * staging list, then the writer waits until either another writer has stored
+ * them or it wins dev->lock itself and stores every command staged so far.
+ * Under many producers one lock holder publishes a whole batch with a single
+ * reader wake-up, while the others only wait for their flag instead of
+ * queueing on the mutex one by one.  Returns once the commands are in the
+ * ring, as the direct path does.  Caller must hold file->lock.
+ *
+ * The wait is killable.  A killed writer withdraws its commands unless a
+ * combiner has already taken them, in which case it waits for that combiner,
+ * which only copies from kernel memory, to finish.
+ * @return 0 once stored, -ERESTARTSYS if withdrawn
+ */
+static int aesd_stage_commands(struct aesd_dev *dev, struct aesd_file *file, size_t len)
+{
+    struct aesd_staged staged = { .file = file, .len = len };
+    struct aesd_stage *stage;
+    bool locked = false;
+    u64 start;
+
+    stage = get_cpu_ptr(dev->stage);
+    spin_lock(&stage->lock);
+    staged.ticket = atomic64_inc_return(&dev->stage_ticket);
+    list_add_tail(&staged.list, &stage->list);
+    spin_unlock(&stage->lock);
+    put_cpu_ptr(dev->stage);
+
+    start = ktime_get_ns();
+    if (wait_event_killable(dev->stageq, smp_load_acquire(&staged.stored) ||
+                                         (locked = mutex_trylock(&dev->lock)))) {
+        bool taken;
+
+        spin_lock(&stage->lock);
+        taken = staged.taken;
+        if (!taken)
+            list_del(&staged.list);
+        spin_unlock(&stage->lock);
+        if (!taken) {
+            atomic64_add(ktime_get_ns() - start, &dev->lock_wait_ns);
+            return -ERESTARTSYS;
         }
+        wait_event(dev->stageq, smp_load_acquire(&staged.stored));
+    }
+    atomic64_add(ktime_get_ns() - start, &dev->lock_wait_ns);
+    if (locked) {
+        dev->lockstat.acquired_ns = ktime_get_ns();
+        aesd_combine(dev);
+        aesd_unlock(dev);
     }
+    return 0;
+}
 
-    mutex_lock(&dev->lock);
+/**
+ * Check whether the @count bytes at the front of @from end with a newline,
+ * without consuming them.
+ */
+static bool aesd_iter_ends_command(struct iov_iter *from, size_t count)
+{
+    char last;
+    size_t copied;
 
-    if (newline_found) {
-        /* Store the complete write in the buffer */
-        new_entry.buffptr = new_buf;
-        new_entry.size = count + dev->partial_size;
+    iov_iter_advance(from, count - 1);
+    copied = copy_from_iter(&last, 1, from);
+    iov_iter_revert(from, count - 1 + copied);
+    return copied == 1 && last == '\n';
+}
 
-        /* Free old data if buffer is full */
-        if (dev->buffer.full)
-            kfree(dev->buffer.entry[dev->buffer.out_offs].buffptr);
+/**
+ * Handles both write() and writev(), serialized per open file by file->lock
+ * while writers on different files run in parallel.
+ *
+ * A write whose last byte completes a command, the usual case, takes
+ * dev->lock and copies the file's staged bytes and then the new bytes
+ * straight from @from into the ring, so its commands are copied only once.
+ * Any other write is staged in the file's own chunks without the device lock,
+ * so one writer's partial command never mixes with another's.  Only if the
+ * staged bytes then complete commands is dev->lock taken to store them,
+ * leaving the trailing partial command staged.  With percpu_staging every
+ * write is staged and completed commands are handed to
+ * aesd_stage_commands(), as the combining writer cannot copy from another
+ * task's @from.  A command that reaches the ring size is stored
+ * unterminated, and writes are cut short so it never exceeds the ring.
+ */
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct aesd_file *file = iocb->ki_filp->private_data;
+    struct aesd_dev *dev;
+    size_t count = iov_iter_count(from);
+    size_t staged, complete;
+    ssize_t copied;
+
+    if (!file)
+        return -EINVAL;
+    dev = file->dev;
+    if (count == 0)
+        return 0;
 
-        aesd_circular_buffer_add_entry(&dev->buffer, &new_entry);
-        dev->partial_size = 0;
-    } else {
-        /* Store partial data for next write */
-        dev->partial_write = new_buf;
-        dev->partial_size += count;
+    PDEBUG("write %zu bytes with offset %lld", count, iocb->ki_pos);
+
+    if (mutex_lock_killable(&file->lock))
+        return -ERESTARTSYS;
+    count = min(count, dev->ring_size - file->partial_size);
+
+    if (!dev->stage && (file->partial_size + count == dev->ring_size ||
+                        aesd_iter_ends_command(from, count))) {
+        size_t stream_end;
+
+        aesd_lock(dev);
+        stream_end = dev->buffer.stream_end;
+        aesd_file_store(dev, file, file->partial_size);
+        copied = aesd_ring_append(dev, NULL, from, count);
+        aesd_wake_readers(dev, stream_end);
+        aesd_unlock(dev);
+        if (copied == 0)
+            copied = -EFAULT;
+        goto out;
     }
 
-    mutex_unlock(&dev->lock);
-    return retval;
+    staged = file->partial_size;
+    copied = aesd_file_stage(file, from, count);
+    if (copied < 0)
+        goto out;
+
+    complete = aesd_file_complete(file, staged);
+    if (!complete && file->partial_size == dev->ring_size)
+        complete = file->partial_size;
+    if (complete) {
+        if (dev->stage) {
+            int result = aesd_stage_commands(dev, file, complete);
+
+            if (result) {
+                // Nothing was stored, a restarted write must not stage its bytes twice
+                aesd_file_unstage(file, staged);
+                copied = result;
+            }
+        } else {
+            size_t stream_end;
+
+            aesd_lock(dev);
+            stream_end = dev->buffer.stream_end;
+            aesd_file_store(dev, file, complete);
+            aesd_wake_readers(dev, stream_end);
+            aesd_unlock(dev);
+        }
+    }
+
+out:
+    mutex_unlock(&file->lock);
+    if (copied > 0) {
+        this_cpu_inc(dev->counters->writes);
+        this_cpu_add(dev->counters->bytes_in, copied);
+    }
+    return copied;
 }
 
 static loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
 {
-    struct aesd_dev *dev = filp->private_data;
+    struct aesd_file *file = filp->private_data;
     loff_t new_fpos = 0;
-    loff_t total_size = 0;
+    loff_t total_size;
+    size_t head, tail;
 
-    mutex_lock(&dev->lock);
-
-    // Calculate total bytes stored in buffer
-    struct aesd_buffer_entry *entry;
-    uint8_t index;
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->buffer, index) {
-        total_size += entry->size;
-    }
+    // Total bytes stored in buffer, maintained by the buffer itself
+    aesd_stream_bounds(file->dev, &head, &tail);
+    total_size = tail - head;
 
     switch (whence) {
         case SEEK_SET:
@@ -169,146 +795,686 @@ static loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
             new_fpos = total_size + offset;
             break;
         default:
-            mutex_unlock(&dev->lock);
             return -EINVAL;
     }
 
     // Validate bounds
-    if (new_fpos < 0 || new_fpos > total_size) {
-        mutex_unlock(&dev->lock);
+    if (new_fpos < 0 || new_fpos > total_size)
         return -EINVAL;
-    }
 
     filp->f_pos = new_fpos;
-
-    mutex_unlock(&dev->lock);
+    file->stream_pos = head + new_fpos;
 
     PDEBUG("llseek: offset=%lld whence=%d -> new pos=%lld", offset, whence, new_fpos);
     return new_fpos;
 }
 
 
-static long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+static long aesd_ioctl_seekto(struct file *filp, struct aesd_file *file, unsigned long arg)
 {
-    struct aesd_dev *dev = filp->private_data;
+    struct aesd_dev *dev = file->dev;
     struct aesd_seekto seekto;
+    struct aesd_circular_buffer snapshot;
+    struct aesd_buffer_entry *entry;
     loff_t new_fpos = 0;
-    uint8_t physical_idx;
-    uint32_t i;
-
-    if (cmd != AESDCHAR_IOCSEEKTO)
-        return -ENOTTY;
+    size_t head = 0;
+    unsigned int seq;
+    long retval;
 
     // Copy struct from userspace
     if (copy_from_user(&seekto, (const void __user *)arg, sizeof(seekto)))
         return -EFAULT;
 
-    mutex_lock(&dev->lock);
+    rcu_read_lock();
+    do {
+        seq = aesd_buffer_snapshot(dev, &snapshot);
+        retval = -EINVAL;
+
+        // Check if command index is out of bounds
+        if (seekto.write_cmd >= aesd_circular_buffer_count(&snapshot))
+            continue;
+
+        // Translate logical index to physical index
+        entry = &snapshot.entry[(snapshot.out_offs + seekto.write_cmd) % snapshot.capacity];
+        if (!READ_ONCE(entry->buffptr) || seekto.write_cmd_offset >= READ_ONCE(entry->size))
+            continue;
 
-    // Check if command index is out of bounds
-    uint8_t total_commands = dev->buffer.full ? AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED :
-                                                dev->buffer.in_offs;
+        // Byte offset from beginning, from the entry's running position
+        new_fpos = aesd_circular_buffer_entry_fpos(&snapshot, seekto.write_cmd) +
+                   seekto.write_cmd_offset;
+        head = snapshot.stream_end - snapshot.total_size;
+        retval = 0;
+    } while (read_seqcount_retry(&dev->seq, seq));
+    rcu_read_unlock();
 
-    if (seekto.write_cmd >= total_commands) {
-        mutex_unlock(&dev->lock);
+    if (retval == 0) {
+        filp->f_pos = new_fpos;
+        file->stream_pos = head + new_fpos;
+    }
+    return retval;
+}
+
+/**
+ * Apply new retention limits: move the entries into storage of the new size,
+ * evicting the oldest ones that exceed either limit.
+ */
+static long aesd_ioctl_set_limits(struct aesd_dev *dev, unsigned long arg)
+{
+    struct aesd_limits limits;
+    struct aesd_buffer_entry *storage, *old_storage;
+
+    if (copy_from_user(&limits, (const void __user *)arg, sizeof(limits)))
+        return -EFAULT;
+
+    if (limits.max_entries == 0 || limits.max_entries > AESDCHAR_MAX_ENTRIES_LIMIT)
         return -EINVAL;
+
+    storage = kvcalloc(limits.max_entries, sizeof(*storage), GFP_KERNEL);
+    if (!storage)
+        return -ENOMEM;
+    atomic_long_inc(&dev->allocations);
+
+    aesd_lock(dev);
+    write_seqcount_begin(&dev->seq);
+
+    while (aesd_circular_buffer_count(&dev->buffer) > limits.max_entries &&
+           aesd_evict_oldest(dev))
+        ;
+
+    old_storage = aesd_circular_buffer_resize(&dev->buffer, storage, limits.max_entries);
+    dev->max_bytes = limits.max_bytes;
+    aesd_evict_to_budget(dev, 0);
+    aesd_ring_publish(dev);
+
+    write_seqcount_end(&dev->seq);
+    aesd_unlock(dev);
+
+    // Lockless readers may still be looking at the old entry array
+    synchronize_rcu();
+    if (old_storage != dev->buffer.entry_storage)
+        kvfree(old_storage);
+
+    PDEBUG("limits: %u entries, %llu bytes", limits.max_entries,
+           (unsigned long long)limits.max_bytes);
+    return 0;
+}
+
+static long aesd_ioctl_get_limits(struct aesd_dev *dev, unsigned long arg)
+{
+    struct aesd_limits limits = { 0 };
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        limits.max_entries = dev->buffer.capacity;
+        limits.max_bytes = dev->max_bytes;
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    if (copy_to_user((void __user *)arg, &limits, sizeof(limits)))
+        return -EFAULT;
+    return 0;
+}
+
+static void aesd_counters_sum(struct aesd_dev *dev, struct aesd_counters *sum)
+{
+    int cpu;
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu) {
+        const struct aesd_counters *c = per_cpu_ptr(dev->counters, cpu);
+
+        sum->writes += READ_ONCE(c->writes);
+        sum->bytes_in += READ_ONCE(c->bytes_in);
+        sum->reads += READ_ONCE(c->reads);
+        sum->bytes_out += READ_ONCE(c->bytes_out);
+        sum->partial_chunks += READ_ONCE(c->partial_chunks);
     }
+}
+
+/**
+ * Report the driver's counters.  Storing a command allocates nothing, its
+ * bytes are copied into the ring, so allocations only grow with open(), a
+ * file's staging buffer growing, AESDCHAR_IOCSETLIMITS and module load.
+ */
+static long aesd_ioctl_get_stats(struct aesd_dev *dev, unsigned long arg)
+{
+    struct aesd_counters counters;
+    struct aesd_stats stats;
+
+    aesd_counters_sum(dev, &counters);
+    aesd_lock(dev);
+    stats = dev->stats;
+    stats.writes = counters.writes;
+    stats.storage_bytes = dev->ring_size + PAGE_SIZE +
+                          (uint64_t)dev->buffer.capacity * sizeof(struct aesd_buffer_entry);
+    stats.entries = aesd_circular_buffer_count(&dev->buffer);
+    stats.bytes = dev->buffer.total_size;
+    stats.first_seq = aesd_circular_buffer_first_seqno(&dev->buffer);
+    stats.next_seq = dev->buffer.seq_end;
+    aesd_unlock(dev);
+    stats.allocations = atomic_long_read(&dev->allocations);
+    stats.lock_wait_ns = atomic64_read(&dev->lock_wait_ns);
+
+    if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+        return -EFAULT;
+    return 0;
+}
 
-    // Translate logical index to physical index
-    physical_idx = (dev->buffer.out_offs + seekto.write_cmd) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    struct aesd_buffer_entry *entry = &dev->buffer.entry[physical_idx];
+/**
+ * Switch tail mode on or off.  Turning it on starts following the stream from
+ * the current file position.
+ */
+static long aesd_ioctl_set_tail(struct file *filp, struct aesd_file *file, unsigned long arg)
+{
+    uint32_t enable;
+    size_t head, tail;
+
+    if (get_user(enable, (const uint32_t __user *)arg))
+        return -EFAULT;
+
+    aesd_stream_bounds(file->dev, &head, &tail);
+    file->stream_pos = head + min_t(size_t, filp->f_pos, tail - head);
+    file->tail = enable != 0;
+    return 0;
+}
+
+/**
+ * Copy whole commands from fetch.seq on, with their descriptors, to the user
+ * buffers in one call.  The descriptors are taken from a snapshot of the
+ * buffer and the payload, contiguous in the ring, is copied at once without
+ * dev->lock, like read().  If a writer reclaimed the first command's bytes
+ * meanwhile, everything is fetched again from the new oldest command.
+ */
+static long aesd_ioctl_fetch(struct aesd_dev *dev, unsigned long arg)
+{
+    struct aesd_fetch fetch;
+    struct aesd_fetch_entry *ents;
+    struct aesd_circular_buffer snapshot;
+    struct aesd_buffer_entry *entry;
+    u64 first_seq, start_seq, index, stored;
+    size_t start = 0, len, size, needed;
+    u32 max_entries, count;
+    unsigned int seq;
+    long retval = 0;
 
-    if (!entry->buffptr || seekto.write_cmd_offset >= entry->size) {
-        mutex_unlock(&dev->lock);
+    if (copy_from_user(&fetch, (const void __user *)arg, sizeof(fetch)))
+        return -EFAULT;
+    if (fetch.max_entries == 0 || fetch.max_entries > AESDCHAR_FETCH_MAX_ENTRIES)
         return -EINVAL;
+    max_entries = fetch.max_entries;
+
+    ents = kvmalloc_array(max_entries, sizeof(*ents), GFP_KERNEL);
+    if (!ents)
+        return -ENOMEM;
+    atomic_long_inc(&dev->allocations);
+
+    for (;;) {
+        rcu_read_lock();
+        do {
+            seq = aesd_buffer_snapshot(dev, &snapshot);
+            first_seq = aesd_circular_buffer_first_seqno(&snapshot);
+            stored = aesd_circular_buffer_count(&snapshot);
+            start_seq = max(fetch.seq, first_seq);
+            count = 0;
+            len = 0;
+            needed = 0;
+
+            for (index = start_seq - first_seq; index < stored && count < max_entries; index++) {
+                entry = &snapshot.entry[(snapshot.out_offs + index) % snapshot.capacity];
+                size = READ_ONCE(entry->size);
+                if (len + size > fetch.buf_len) {
+                    if (count == 0)
+                        needed = size;
+                    break;
+                }
+                if (count == 0)
+                    start = READ_ONCE(entry->stream_offset);
+                ents[count].seq = start_seq + count;
+                ents[count].offset = len;
+                ents[count].size = size;
+                len += size;
+                count++;
+            }
+        } while (read_seqcount_retry(&dev->seq, seq));
+        rcu_read_unlock();
+
+        if (count == 0)
+            break;
+        if (copy_to_user(u64_to_user_ptr(fetch.buf), dev->ring + aesd_ring_offset(dev, start), len)) {
+            retval = -EFAULT;
+            goto out;
+        }
+
+        // Keep the copy only if no writer reused those bytes meanwhile
+        smp_rmb();
+        if (READ_ONCE(dev->reclaim) <= start)
+            break;
     }
 
-    // Calculate byte offset from beginning
-    for (i = 0; i < seekto.write_cmd; i++) {
-        uint8_t idx = (dev->buffer.out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-        new_fpos += dev->buffer.entry[idx].size;
+    if (copy_to_user(u64_to_user_ptr(fetch.entries), ents, count * sizeof(*ents))) {
+        retval = -EFAULT;
+        goto out;
     }
+    fetch.seq = start_seq;
+    fetch.count = count;
+    fetch.bytes = needed ? needed : len;
+    fetch.next_seq = start_seq + count;
+    if (copy_to_user((void __user *)arg, &fetch, sizeof(fetch)))
+        retval = -EFAULT;
+    else if (needed)
+        retval = -ENOSPC;
+
+out:
+    kvfree(ents);
+    return retval;
+}
+
+/**
+ * Move the file position to the start of the command with the given
+ * sequence number, or of the oldest one if it was evicted, and report the
+ * number positioned at.
+ */
+static long aesd_ioctl_seek_seq(struct file *filp, struct aesd_file *file, unsigned long arg)
+{
+    struct aesd_dev *dev = file->dev;
+    struct aesd_circular_buffer snapshot;
+    u64 want, first_seq, found = 0;
+    loff_t new_fpos = 0;
+    size_t head = 0;
+    unsigned int seq;
+    long retval;
+
+    if (get_user(want, (u64 __user *)arg))
+        return -EFAULT;
 
-    new_fpos += seekto.write_cmd_offset;
+    rcu_read_lock();
+    do {
+        seq = aesd_buffer_snapshot(dev, &snapshot);
+        retval = -EINVAL;
+
+        // Numbers not handed out yet
+        if (want > snapshot.seq_end)
+            continue;
+
+        first_seq = aesd_circular_buffer_first_seqno(&snapshot);
+        found = max(want, first_seq);
+        if (found == snapshot.seq_end)
+            new_fpos = snapshot.total_size;
+        else
+            new_fpos = aesd_circular_buffer_entry_fpos(&snapshot, found - first_seq);
+        head = snapshot.stream_end - snapshot.total_size;
+        retval = 0;
+    } while (read_seqcount_retry(&dev->seq, seq));
+    rcu_read_unlock();
+
+    if (retval)
+        return retval;
+    if (put_user(found, (u64 __user *)arg))
+        return -EFAULT;
     filp->f_pos = new_fpos;
+    file->stream_pos = head + new_fpos;
+    return 0;
+}
 
-    mutex_unlock(&dev->lock);
+static long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+
+    switch (cmd) {
+        case AESDCHAR_IOCSEEKTO:
+            return aesd_ioctl_seekto(filp, file, arg);
+        case AESDCHAR_IOCSETLIMITS:
+            return aesd_ioctl_set_limits(dev, arg);
+        case AESDCHAR_IOCGETLIMITS:
+            return aesd_ioctl_get_limits(dev, arg);
+        case AESDCHAR_IOCSETTAIL:
+            return aesd_ioctl_set_tail(filp, file, arg);
+        case AESDCHAR_IOCGETSTATS:
+            return aesd_ioctl_get_stats(dev, arg);
+        case AESDCHAR_IOCFETCH:
+            return aesd_ioctl_fetch(dev, arg);
+        case AESDCHAR_IOCSEEKSEQ:
+            return aesd_ioctl_seek_seq(filp, file, arg);
+        default:
+            return -ENOTTY;
+    }
+}
+
+/**
+ * Map the header page at offset 0 and the ring pages twice after it, see
+ * struct aesd_ring_header.  Pages are inserted on first touch.
+ */
+static vm_fault_t aesd_mmap_fault(struct vm_fault *vmf)
+{
+    struct aesd_dev *dev = vmf->vma->vm_private_data;
+    unsigned long nr_pages = dev->ring_size >> PAGE_SHIFT;
+    struct page *page;
+
+    if (vmf->pgoff == 0)
+        page = dev->header_page;
+    else if (vmf->pgoff <= 2 * nr_pages)
+        page = dev->ring_pages[(vmf->pgoff - 1) % nr_pages];
+    else
+        return VM_FAULT_SIGBUS;
+
+    get_page(page);
+    vmf->page = page;
+    return 0;
+}
+
+static const struct vm_operations_struct aesd_vm_ops = {
+    .fault = aesd_mmap_fault,
+};
+
+static int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    unsigned long nr_pages = dev->ring_size >> PAGE_SHIFT;
+
+    // Read-only view, commands are only added through write()
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+    if (vma->vm_pgoff + vma_pages(vma) > 1 + 2 * nr_pages)
+        return -EINVAL;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    vma->vm_ops = &aesd_vm_ops;
+    vma->vm_private_data = dev;
     return 0;
 }
-	
 
 struct file_operations aesd_fops = {
     .owner 		=	THIS_MODULE,
-    .read 		=     	aesd_read,
-    .write 		=    	aesd_write,
+    .read_iter 		=     	aesd_read_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read 	=     	copy_splice_read,
+#else
+    .splice_read 	=     	generic_file_splice_read,
+#endif
+    .write_iter 	=    	aesd_write_iter,
     .open 		=     	aesd_open,
     .release 		=  	aesd_release,
     .llseek 		=   	aesd_llseek,
     .unlocked_ioctl 	= 	aesd_unlocked_ioctl,
+    .mmap 		=	aesd_mmap,
+    .poll 		=	aesd_poll,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static void aesd_ring_free(struct aesd_dev *dev)
+{
+    unsigned long i;
+
+    if (dev->ring)
+        vunmap(dev->ring);
+    if (dev->ring_pages) {
+        for (i = 0; i < dev->ring_size >> PAGE_SHIFT; i++) {
+            if (dev->ring_pages[i])
+                __free_page(dev->ring_pages[i]);
+        }
+        kvfree(dev->ring_pages);
+    }
+    if (dev->header_page)
+        __free_page(dev->header_page);
+}
+
+/**
+ * Allocate a ring of @size bytes, a power-of-two multiple of PAGE_SIZE, and
+ * map its pages twice in a row so any @size bytes from any offset are
+ * contiguous.
+ */
+static int aesd_ring_alloc(struct aesd_dev *dev, size_t size)
+{
+    unsigned long nr_pages = size >> PAGE_SHIFT;
+    struct page **map;
+    unsigned long i;
+
+    dev->ring_size = size;
+    dev->ring_pages = kvcalloc(nr_pages, sizeof(*dev->ring_pages), GFP_KERNEL);
+    dev->header_page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+    map = kvmalloc_array(2 * nr_pages, sizeof(*map), GFP_KERNEL);
+    if (!dev->ring_pages || !dev->header_page || !map)
+        goto fail;
+
+    for (i = 0; i < nr_pages; i++) {
+        dev->ring_pages[i] = alloc_page(GFP_KERNEL);
+        if (!dev->ring_pages[i])
+            goto fail;
+        map[i] = map[nr_pages + i] = dev->ring_pages[i];
+    }
+    dev->ring = vmap(map, 2 * nr_pages, VM_MAP, PAGE_KERNEL);
+    if (!dev->ring)
+        goto fail;
+    kvfree(map);
+    atomic_long_add(nr_pages + 3, &dev->allocations);
+
+    dev->header = page_address(dev->header_page);
+    dev->header->magic = AESDCHAR_RING_MAGIC;
+    dev->header->page_size = PAGE_SIZE;
+    dev->header->data_size = size;
+    return 0;
+
+fail:
+    kvfree(map);
+    aesd_ring_free(dev);
+    return -ENOMEM;
+}
+
+static int aesd_stage_alloc(struct aesd_dev *dev)
+{
+    int cpu;
+
+    dev->stage = alloc_percpu(struct aesd_stage);
+    if (!dev->stage)
+        return -ENOMEM;
+    atomic_long_inc(&dev->allocations);
+
+    for_each_possible_cpu(cpu) {
+        struct aesd_stage *stage = per_cpu_ptr(dev->stage, cpu);
+
+        spin_lock_init(&stage->lock);
+        INIT_LIST_HEAD(&stage->list);
+    }
+    return 0;
+}
+
+static int aesd_setup_cdev(struct aesd_dev *dev, unsigned int index)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
     dev->cdev.ops = &aesd_fops;
     err = cdev_add (&dev->cdev, devno, 1);
     if (err) {
-        printk(KERN_ERR "Error %d adding aesd cdev", err);
+        printk(KERN_ERR "Error %d adding aesd cdev %u", err, index);
     }
     return err;
 }
 
+static void aesd_hist_show(struct seq_file *m, const char *name, const u64 *hist)
+{
+    unsigned int i;
+
+    seq_printf(m, "%s:\n", name);
+    for (i = 0; i < AESD_HIST_BUCKETS; i++) {
+        if (hist[i])
+            seq_printf(m, "  >= %10llu ns: %llu\n", i ? 1ULL << i : 0ULL, hist[i]);
+    }
+}
+
+/**
+ * debugfs aesdchar/aesdcharN/stats: all counters of one device, with the
+ * dev->lock wait and hold times as power-of-two histograms.
+ */
+static int aesd_debugfs_stats_show(struct seq_file *m, void *unused)
+{
+    struct aesd_dev *dev = m->private;
+    struct aesd_lock_stats lockstat;
+    struct aesd_counters counters;
+    struct aesd_stats stats;
+
+    aesd_counters_sum(dev, &counters);
+    aesd_lock(dev);
+    stats = dev->stats;
+    stats.entries = aesd_circular_buffer_count(&dev->buffer);
+    stats.bytes = dev->buffer.total_size;
+    lockstat = dev->lockstat;
+    aesd_unlock(dev);
+
+    seq_printf(m, "writes: %llu\nbytes_in: %llu\nreads: %llu\nbytes_out: %llu\n",
+               counters.writes, counters.bytes_in, counters.reads, counters.bytes_out);
+    seq_printf(m, "commands: %llu\nevictions: %llu\nentries: %llu\nbytes: %llu\n",
+               stats.commands, stats.evictions, stats.entries, stats.bytes);
+    seq_printf(m, "partial_chunks: %llu\nallocations: %ld\n",
+               counters.partial_chunks, atomic_long_read(&dev->allocations));
+    seq_printf(m, "lock_contended: %llu\nlock_wait_ns: %lld\n",
+               lockstat.contended, (long long)atomic64_read(&dev->lock_wait_ns));
+    aesd_hist_show(m, "lock_wait_hist", lockstat.wait_hist);
+    aesd_hist_show(m, "lock_hold_hist", lockstat.hold_hist);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_debugfs_stats);
+
+/**
+ * Set up device @index with its own buffer, ring, lock and stats, and make it
+ * visible as minor aesd_minor + @index.
+ */
+static int aesd_dev_init(struct aesd_dev *dev, unsigned int index)
+{
+    struct aesd_buffer_entry *storage;
+    char name[16];
+    int result = -ENOMEM;
+
+    storage = kvcalloc(max_entries, sizeof(*storage), GFP_KERNEL);
+    dev->counters = alloc_percpu(struct aesd_counters);
+    if (!storage || !dev->counters)
+        goto fail;
+    atomic_long_set(&dev->allocations, 2);
+    result = aesd_ring_alloc(dev, roundup_pow_of_two(max(ring_size, PAGE_SIZE)));
+    if (result)
+        goto fail;
+    if (percpu_staging) {
+        result = aesd_stage_alloc(dev);
+        if (result)
+            goto fail_ring;
+    }
+
+    /* Initialize buffer */
+    aesd_circular_buffer_init_storage(&dev->buffer, storage, max_entries);
+    dev->max_bytes = max_bytes;
+    mutex_init(&dev->lock);                   /* Initialize mutex */
+    seqcount_mutex_init(&dev->seq, &dev->lock);
+    init_waitqueue_head(&dev->readq);
+    init_waitqueue_head(&dev->stageq);
+    dev->partial_size = 0;
+
+    result = aesd_setup_cdev(dev, index);
+    if (result)
+        goto fail_stage;
+
+    // debugfs is best effort, the device works without it
+    snprintf(name, sizeof(name), "aesdchar%u", index);
+    dev->debugfs = debugfs_create_dir(name, aesd_debugfs_root);
+    debugfs_create_file("stats", 0444, dev->debugfs, dev, &aesd_debugfs_stats_fops);
+    return 0;
+
+fail_stage:
+    mutex_destroy(&dev->lock);
+    free_percpu(dev->stage);
+fail_ring:
+    aesd_ring_free(dev);
+fail:
+    free_percpu(dev->counters);
+    kvfree(storage);
+    return result;
+}
+
+static void aesd_dev_cleanup(struct aesd_dev *dev)
+{
+    debugfs_remove_recursive(dev->debugfs);
+    cdev_del(&dev->cdev);
 
+    /* Free all allocated memory, the commands live in the ring */
+    aesd_ring_free(dev);
+    kvfree(dev->buffer.entry);
+    free_percpu(dev->stage);
+    free_percpu(dev->counters);
+
+    mutex_destroy(&dev->lock);
+}
 
 int aesd_init_module(void)
 {
     dev_t dev = 0;
+    unsigned int i;
     int result;
-    result = alloc_chrdev_region(&dev, aesd_minor, 1,
+
+    if (nr_devices == 0 || nr_devices > AESDCHAR_MAX_DEVICES) {
+        printk(KERN_WARNING "aesdchar: nr_devices must be 1-%u\n", AESDCHAR_MAX_DEVICES);
+        return -EINVAL;
+    }
+    if (max_entries == 0 || max_entries > AESDCHAR_MAX_ENTRIES_LIMIT) {
+        printk(KERN_WARNING "aesdchar: max_entries must be 1-%u\n", AESDCHAR_MAX_ENTRIES_LIMIT);
+        return -EINVAL;
+    }
+    if (ring_size == 0 || ring_size > AESDCHAR_MAX_RING_SIZE) {
+        printk(KERN_WARNING "aesdchar: ring_size must be 1-%lu\n", AESDCHAR_MAX_RING_SIZE);
+        return -EINVAL;
+    }
+
+    result = alloc_chrdev_region(&dev, aesd_minor, nr_devices,
             "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
         return result;
     }
-    memset(&aesd_device,0,sizeof(struct aesd_dev));
-     
-    aesd_circular_buffer_init(&aesd_device.buffer);  /* Initialize buffer */
-    mutex_init(&aesd_device.lock);                   /* Initialize mutex */
-    aesd_device.partial_write = NULL;
-    aesd_device.partial_size = 0;
 
-    result = aesd_setup_cdev(&aesd_device);
+    aesd_chunk_cache = kmem_cache_create("aesd_chunk", PAGE_SIZE, 0, 0, NULL);
+    aesd_devices = kcalloc(nr_devices, sizeof(*aesd_devices), GFP_KERNEL);
+    if (!aesd_chunk_cache || !aesd_devices) {
+        result = -ENOMEM;
+        goto fail;
+    }
 
-    if( result ) {
-        unregister_chrdev_region(dev, 1);
+    aesd_debugfs_root = debugfs_create_dir("aesdchar", NULL);
+    for (i = 0; i < nr_devices; i++) {
+        result = aesd_dev_init(&aesd_devices[i], i);
+        if (result)
+            goto fail_devices;
     }
-    return result;
+    return 0;
 
+fail_devices:
+    while (i--)
+        aesd_dev_cleanup(&aesd_devices[i]);
+    debugfs_remove_recursive(aesd_debugfs_root);
+fail:
+    kfree(aesd_devices);
+    kmem_cache_destroy(aesd_chunk_cache);
+    unregister_chrdev_region(dev, nr_devices);
+    return result;
 }
 
 void aesd_cleanup_module(void)
 {
-    struct aesd_buffer_entry *entry;
-    uint8_t index;
     dev_t devno = MKDEV(aesd_major, aesd_minor);
+    unsigned int i;
 
-    cdev_del(&aesd_device.cdev);
-
-    /* Free all allocated memory */
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.buffer, index) {
-        if (entry->buffptr) {
-            kfree(entry->buffptr);
-        }
-    }
+    for (i = 0; i < nr_devices; i++)
+        aesd_dev_cleanup(&aesd_devices[i]);
+    debugfs_remove_recursive(aesd_debugfs_root);
+    kfree(aesd_devices);
+    kmem_cache_destroy(aesd_chunk_cache);
 
-    mutex_destroy(&aesd_device.lock);
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, nr_devices);
 }
 
 module_init(aesd_init_module);
 module_exit(aesd_cleanup_module);
-
@@ -5,14 +5,35 @@
  *
  * - Binds to TCP port 9000
  * - Waits for incoming connections
- * - Spawns a new thread for each connection (allowing simultaneous clients)
- * - Receives data, appends to /dev/aesdchar (DATAFILE_PATH) when enabled
- * - On each newline, sends the entire file content back to the client
+ * - Spawns a new thread for each connection (allowing simultaneous clients),
+ *   hands connections to a fixed worker pool with -m pool, or with -m epoll
+ *   serves all clients from edge-triggered epoll reactors, or with -m uring
+ *   from a single io_uring loop (falling back to threads when unavailable)
+ * - Receives data, appends to /dev/aesdchar (DATAFILE_PATH) when enabled;
+ *   received bytes are buffered per connection and appended as complete
+ *   lines, all lines of one receive batch with a single write
+ * - After each batch ending in a newline, sends the entire file content back
+ *   to the client once, or
+ *   after "AESDSOCKET_ECHO:incremental" only what was appended since that
+ *   client's previous echo (served from an in-memory copy of the file)
  * - Logs "Accepted connection from XXX" and "Closed connection from XXX"
  * - Continues in a loop until SIGINT or SIGTERM
  * - On signal, logs "Caught signal, exiting", stops accepting, joins threads,
  *   removes file (if not using aesdchar), and gracefully exits
  * - Supports a -d option to run as a daemon
+ * - Supports -m thread|pool|epoll|uring to pick the connection handling mode
+ *   and -n COUNT for the number of pool workers (default: online CPUs), epoll
+ *   reactor threads (default: 1) or io_uring connection slots (default: 256)
+ * - Supports -s COUNT to shard clients by address across COUNT data files
+ *   (/dev/aesdchar0..COUNT-1 in the driver build) instead of one
+ * - Supports -g to append through a single writer thread that group commits
+ *   the lines of all clients pending at once, in thread and pool modes (-m
+ *   uring keeps its own batched writes, -m epoll ignores -g since waiting for
+ *   the writer would stall every client of a reactor)
+ * - Supports -y none|periodic|batch|dsync to choose when the /var/tmp data
+ *   file is forced to storage: never, every DATAFILE_SYNC_INTERVAL seconds
+ *   from the timer thread, after every append or group commit batch, or on
+ *   every write through O_DSYNC
  ****************************************************************************/
 
 #include <stdio.h>
@@ -26,35 +47,37 @@
 #include <syslog.h>
 #include <signal.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
 #include <errno.h>
 #include <pthread.h>
-#include <sys/queue.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <time.h>
-#include "../aesd-char-driver/aesd_ioctl.h"
+#include "queue.h"
+#include "aesdsocket.h"
 
 
-#define SERVER_PORT "9000"
-
-#ifdef USE_AESD_CHAR_DEVICE
-    #define DATAFILE_PATH "/dev/aesdchar"
-#else
-    #define DATAFILE_PATH "/var/tmp/aesdsocketdata"
-#endif
-
-#define BUF_MAXLEN 1024
-
 static int g_socketfd = -1;
-static pthread_mutex_t g_file_mutex;
-static volatile sig_atomic_t g_exit_flag = 0;
+volatile sig_atomic_t g_exit_flag = 0;
+static volatile sig_atomic_t g_exit_signal = 0;
+int g_wakeup_fd = -1;
 
 #ifndef USE_AESD_CHAR_DEVICE
 static pthread_t g_timer_thread;
+
+/* Seconds between timestamp lines */
+#define TIMESTAMP_INTERVAL 10
 #endif
 
+/* Wakes the timer thread early when shutting down */
+static pthread_mutex_t g_exit_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_exit_cond;
+
 struct thread_list_node {
     pthread_t thread_id;
     int client_fd;
     struct sockaddr_in client_addr;
+    atomic_bool complete;       /* set by the thread once the client is served */
     SLIST_ENTRY(thread_list_node) entries;
 };
 
@@ -64,26 +87,54 @@ SLIST_HEAD(thread_list_head, thread_list_node) g_thread_list_head;
  * @brief Signal handler to request shutdown on SIGINT/SIGTERM.
  */
 static void handle_exit(int sig) {
-    syslog(LOG_INFO, "Caught signal %d, exiting", sig);
+    /* syslog() is not async-signal-safe; main logs the signal on the way out */
+    g_exit_signal = sig;
     g_exit_flag = 1;
 
+    if (g_wakeup_fd != -1) {
+        uint64_t one = 1;
+        ssize_t rc = write(g_wakeup_fd, &one, sizeof(one));
+        (void)rc;
+    }
+
+    /* shutdown() rather than close() so an accept() blocked in another
+     * thread returns; main closes the socket */
     if (g_socketfd != -1) {
-        close(g_socketfd);
-        g_socketfd = -1;
+        shutdown(g_socketfd, SHUT_RDWR);
     }
 }
 
 #ifndef USE_AESD_CHAR_DEVICE
 /**
- * @brief Timer thread to append timestamp every 10 seconds
+ * @brief Timer thread to append timestamp every 10 seconds, and with
+ * -y periodic to sync the data files every DATAFILE_SYNC_INTERVAL seconds
  */
 static void* timer_thread_func(void* arg) {
+    bool periodic = datafile_durability() == DURABILITY_PERIODIC;
+    unsigned int interval = periodic ? DATAFILE_SYNC_INTERVAL : TIMESTAMP_INTERVAL;
+    unsigned int elapsed = 0;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
     while (!g_exit_flag) {
-        sleep(10);
+        deadline.tv_sec += interval;
+
+        pthread_mutex_lock(&g_exit_mutex);
+        while (!g_exit_flag &&
+               pthread_cond_timedwait(&g_exit_cond, &g_exit_mutex, &deadline) != ETIMEDOUT)
+            ;
+        pthread_mutex_unlock(&g_exit_mutex);
         if (g_exit_flag) break;
 
+        if (periodic)
+            datafile_sync_periodic();
+        elapsed += interval;
+        if (elapsed % TIMESTAMP_INTERVAL != 0)
+            continue;
+
         time_t now = time(NULL);
-        struct tm* tinfo = localtime(&now);
+        struct tm tbuf;
+        struct tm* tinfo = localtime_r(&now, &tbuf);
         if (!tinfo) {
             syslog(LOG_ERR, "localtime failed: %s", strerror(errno));
             continue;
@@ -92,112 +143,123 @@ static void* timer_thread_func(void* arg) {
         char timestr[128];
         strftime(timestr, sizeof(timestr), "%a, %d %b %Y %T %z", tinfo);
 
-        pthread_mutex_lock(&g_file_mutex);
-        int fd = open(DATAFILE_PATH, O_WRONLY | O_APPEND);
-        if (fd >= 0) {
-            dprintf(fd, "timestamp:%s\n", timestr);
-            close(fd);
-        } else {
-            syslog(LOG_ERR, "Failed to write timestamp: %s", strerror(errno));
+        char line[160];
+        int len = snprintf(line, sizeof(line), "timestamp:%s\n", timestr);
+        for (unsigned int shard = 0; shard < datafile_shards(); shard++) {
+            if (datafile_append(shard, line, len) != 0)
+                syslog(LOG_ERR, "Failed to write timestamp");
         }
-        pthread_mutex_unlock(&g_file_mutex);
     }
     return NULL;
 }
 #endif
 
 /**
- * @brief Thread function to handle a client connection.
+ * @brief Serve one client connection on a blocking socket until it closes.
+ * The caller owns @param client_fd and closes it afterwards, so it may
+ * shutdown() the socket from another thread to end the session early.
  */
-static void* client_thread_func(void *arg) {
-    struct thread_list_node *node = (struct thread_list_node *)arg;
-    int client_fd = node->client_fd;
-    struct sockaddr_in caddr = node->client_addr;
-    char *client_ip = inet_ntoa(caddr.sin_addr);
+void client_serve(int client_fd, const struct sockaddr_in *client_addr) {
+    char client_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client_addr->sin_addr, client_ip, sizeof(client_ip));
     syslog(LOG_INFO, "Accepted connection from %s", client_ip);
 
-    char rx_buffer[BUF_MAXLEN + 1];
-    ssize_t rx_bytes;
-
-    while ((rx_bytes = recv(client_fd, rx_buffer, BUF_MAXLEN, 0)) > 0) {
-        rx_buffer[rx_bytes] = '\0';
-
-#ifdef USE_AESD_CHAR_DEVICE
-        if (strncmp(rx_buffer, "AESDCHAR_IOCSEEKTO:", strlen("AESDCHAR_IOCSEEKTO:")) == 0) {
-            unsigned int write_cmd, write_cmd_offset;
-            char *params = rx_buffer + strlen("AESDCHAR_IOCSEEKTO:");
-
-            if (sscanf(params, "%u,%u", &write_cmd, &write_cmd_offset) == 2) {
-                int fd = open(DATAFILE_PATH, O_RDWR);
-                if (fd < 0) {
-                    syslog(LOG_ERR, "Failed to open %s for ioctl: %s", DATAFILE_PATH, strerror(errno));
+    unsigned int shard = datafile_shard(client_addr);
+    struct linebuf rx;
+    struct linebuf_batch batch;
+    enum linebuf_batch_kind kind;
+    bool incremental = false;
+    struct applog_cursor cursor = {0};
+    bool closing = false;
+
+    linebuf_init(&rx);
+    while (!closing) {
+        size_t avail;
+        char *space = linebuf_space(&rx, &avail);
+        ssize_t rx_bytes = space ? recv(client_fd, space, avail, 0) : -1;
+        if (rx_bytes < 0 && errno == EINTR)
+            continue;
+        if (rx_bytes > 0)
+            linebuf_commit(&rx, rx_bytes);
+        else
+            closing = true;     // still append a trailing partial line
+
+        while ((kind = linebuf_next_batch(&rx, &batch, closing)) != LINEBUF_BATCH_NONE) {
+            const char *line = batch.iov[0].iov_base;
+            size_t line_len = batch.iov[0].iov_len;
+
+            if (kind == LINEBUF_BATCH_COMMAND) {
+                int echo_mode = applog_echo_command(line, line_len);
+                if (echo_mode >= 0) {
+                    if (echo_mode && !incremental)
+                        applog_cursor_init(&cursor, shard);
+                    else if (!echo_mode && incremental)
+                        applog_cursor_release(&cursor);
+                    incremental = echo_mode;
                 } else {
-                    struct aesd_seekto seekto;
-                    seekto.write_cmd = write_cmd;
-                    seekto.write_cmd_offset = write_cmd_offset;
-
-                    if (ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto) == -1) {
-                        syslog(LOG_ERR, "ioctl AESDCHAR_IOCSEEKTO failed: %s", strerror(errno));
-                        close(fd);
-                        pthread_mutex_unlock(&g_file_mutex);
-                        continue;
-                    }
-
                     // Perform a read from the new file position and send to client
-                    char send_buffer[BUF_MAXLEN];
-                    ssize_t bytes_read;
-                    while ((bytes_read = read(fd, send_buffer, BUF_MAXLEN)) > 0) {
-                        send(client_fd, send_buffer, bytes_read, 0);
-                    }
-
-                    close(fd);
+                    int fd = datafile_open_seekto(shard, line, line_len);
+                    if (fd >= 0)
+                        datafile_echo(client_fd, shard, fd);
+                }
+            } else {
+                // All complete lines received so far go out in one write
+                if (datafile_appendv(shard, batch.iov, batch.iovcnt) != 0) {
+                    closing = true;
+                    break;
                 }
-                pthread_mutex_unlock(&g_file_mutex);
-                continue; // skip normal write path
-            }
-        }
-#endif
-
-        // Normal write
-        pthread_mutex_lock(&g_file_mutex);
-        int fd = open(DATAFILE_PATH, O_WRONLY | O_APPEND);
-        if (fd < 0) {
-            syslog(LOG_ERR, "Failed to open for write: %s", strerror(errno));
-            pthread_mutex_unlock(&g_file_mutex);
-            break;
-        }
-
-        write(fd, rx_buffer, rx_bytes);
-        close(fd);
-        pthread_mutex_unlock(&g_file_mutex);
-
-        // Echo back only on newline
-        if (memchr(rx_buffer, '\n', rx_bytes)) {
-            pthread_mutex_lock(&g_file_mutex);
-            fd = open(DATAFILE_PATH, O_RDONLY);
-            if (fd < 0) {
-                syslog(LOG_ERR, "Failed to open for read: %s", strerror(errno));
-                pthread_mutex_unlock(&g_file_mutex);
-                break;
-            }
 
-            char send_buf[BUF_MAXLEN];
-            ssize_t bytes_read;
-            while ((bytes_read = read(fd, send_buf, BUF_MAXLEN)) > 0) {
-                send(client_fd, send_buf, bytes_read, 0);
+                // One echo per batch, and only once a newline arrived
+                if (batch.terminated) {
+                    if (incremental && applog_cursor_mark(&cursor) != 0)
+                        incremental = false;
+                    if (incremental)
+                        applog_cursor_send(&cursor, client_fd);
+                    else
+                        datafile_echo(client_fd, shard, -1);
+                }
             }
-
-            close(fd);
-            pthread_mutex_unlock(&g_file_mutex);
+            linebuf_consume(&rx, batch.len);
         }
     }
 
+    linebuf_free(&rx);
+    if (incremental)
+        applog_cursor_release(&cursor);
+
     shutdown(client_fd, SHUT_RDWR);
-    close(client_fd);
     syslog(LOG_INFO, "Closed connection from %s", client_ip);
+}
+
+/**
+ * @brief Thread function to handle a client connection.
+ */
+static void* client_thread_func(void *arg) {
+    struct thread_list_node *node = (struct thread_list_node *)arg;
+    client_serve(node->client_fd, &node->client_addr);
+    atomic_store(&node->complete, true);
     return NULL;
 }
 
+/**
+ * @brief Join client threads that have finished and release their nodes.
+ * With @param all set, remaining clients are shut down and joined too.
+ */
+static void thread_list_reap(bool all) {
+    struct thread_list_node *node, *tmp;
+
+    SLIST_FOREACH_SAFE(node, &g_thread_list_head, entries, tmp) {
+        if (!all && !atomic_load(&node->complete))
+            continue;
+        if (!atomic_load(&node->complete))
+            shutdown(node->client_fd, SHUT_RDWR);
+        pthread_join(node->thread_id, NULL);
+        close(node->client_fd);
+        SLIST_REMOVE(&g_thread_list_head, node, thread_list_node, entries);
+        free(node);
+    }
+}
+
 /**
  * @brief Run as a daemon process.
  */
@@ -213,16 +275,144 @@ static void daemon_run(void) {
     close(STDERR_FILENO);
 }
 
+/**
+ * @brief Accept connections and spawn a thread for each until shutdown.
+ */
+static void thread_mode_run(void) {
+    struct sockaddr_in client_addr;
+    socklen_t addr_len = sizeof(client_addr);
+    while (!g_exit_flag) {
+        int new_fd = accept(g_socketfd, (struct sockaddr*)&client_addr, &addr_len);
+        thread_list_reap(false);
+        if (new_fd < 0) continue;
+        struct thread_list_node *new_node = malloc(sizeof(*new_node));
+        if (!new_node) {
+            close(new_fd);
+            continue;
+        }
+        new_node->client_fd = new_fd;
+        memcpy(&new_node->client_addr, &client_addr, sizeof(client_addr));
+        atomic_init(&new_node->complete, false);
+        if (pthread_create(&new_node->thread_id, NULL, client_thread_func, new_node) != 0) {
+            syslog(LOG_ERR, "pthread_create failed");
+            close(new_fd);
+            free(new_node);
+            continue;
+        }
+        SLIST_INSERT_HEAD(&g_thread_list_head, new_node, entries);
+    }
+    thread_list_reap(true);
+}
+
+/**
+ * @brief Accept connections and hand them to the worker pool until shutdown.
+ */
+static void pool_mode_run(void) {
+    struct sockaddr_in client_addr;
+    socklen_t addr_len = sizeof(client_addr);
+    while (!g_exit_flag) {
+        int new_fd = accept(g_socketfd, (struct sockaddr*)&client_addr, &addr_len);
+        if (new_fd < 0) continue;
+        if (threadpool_submit(new_fd, &client_addr) != 0)
+            close(new_fd);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d] [-m thread|pool|epoll|uring] [-n COUNT] [-s COUNT] [-g]\n"
+                    "       [-y none|periodic|batch|dsync]\n"
+                    "-g groups appends in thread and pool modes; epoll ignores it and uring\n"
+                    "batches its own\n", prog);
+}
+
 int main(int argc, char *argv[]) {
+    int run_as_daemon = 0;
+    enum server_mode mode = SERVER_MODE_THREAD;
+    unsigned int count = 0;
+    unsigned int shards = 1;
+    bool group_commit = false;
+    enum datafile_durability durability = DURABILITY_NONE;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "dm:n:s:gy:")) != -1) {
+        switch (opt) {
+        case 'd':
+            run_as_daemon = 1;
+            break;
+        case 'm':
+            if (strcmp(optarg, "thread") == 0) {
+                mode = SERVER_MODE_THREAD;
+            } else if (strcmp(optarg, "pool") == 0) {
+                mode = SERVER_MODE_POOL;
+            } else if (strcmp(optarg, "epoll") == 0) {
+                mode = SERVER_MODE_EPOLL;
+            } else if (strcmp(optarg, "uring") == 0) {
+                mode = SERVER_MODE_URING;
+            } else {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'n':
+            count = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            shards = (unsigned int)strtoul(optarg, NULL, 10);
+            if (shards == 0 || shards > DATAFILE_MAX_SHARDS) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'g':
+            group_commit = true;
+            break;
+        case 'y':
+            if (strcmp(optarg, "none") == 0) {
+                durability = DURABILITY_NONE;
+            } else if (strcmp(optarg, "periodic") == 0) {
+                durability = DURABILITY_PERIODIC;
+            } else if (strcmp(optarg, "batch") == 0) {
+                durability = DURABILITY_BATCH;
+            } else if (strcmp(optarg, "dsync") == 0) {
+                durability = DURABILITY_DSYNC;
+            } else {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
     openlog("aesdsocket", LOG_PID | LOG_CONS, LOG_USER);
+    if (group_commit && mode == SERVER_MODE_EPOLL) {
+        // A reactor waiting on the writer would stall all of its other clients
+        syslog(LOG_WARNING, "-g is not supported with -m epoll, appending directly");
+        group_commit = false;
+    }
     signal(SIGINT, handle_exit);
     signal(SIGTERM, handle_exit);
-    pthread_mutex_init(&g_file_mutex, NULL);
+    // sendfile()/splice() have no MSG_NOSIGNAL; a client leaving mid-echo must not kill us
+    signal(SIGPIPE, SIG_IGN);
     SLIST_INIT(&g_thread_list_head);
 
-    int run_as_daemon = (argc == 2 && strcmp(argv[1], "-d") == 0);
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_exit_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
     if (run_as_daemon) daemon_run();
 
+    g_wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (g_wakeup_fd < 0) {
+        syslog(LOG_ERR, "eventfd failed: %s", strerror(errno));
+        closelog();
+        return -1;
+    }
+
     struct addrinfo hints = {0}, *servinfo;
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_STREAM;
@@ -242,23 +432,61 @@ int main(int argc, char *argv[]) {
     freeaddrinfo(servinfo);
     if (listen(g_socketfd, SOMAXCONN) < 0) return -1;
 
+    if (datafile_init(shards, durability) != 0 || applog_init(shards) != 0 ||
+        (group_commit && writer_start() != 0)) {
+        closelog();
+        return -1;
+    }
+
 #ifndef USE_AESD_CHAR_DEVICE
     pthread_create(&g_timer_thread, NULL, timer_thread_func, NULL);
 #endif
 
-    struct sockaddr_in client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-    while (!g_exit_flag) {
-        int new_fd = accept(g_socketfd, (struct sockaddr*)&client_addr, &addr_len);
-        if (new_fd < 0) continue;
-        struct thread_list_node *new_node = malloc(sizeof(*new_node));
-        new_node->client_fd = new_fd;
-        memcpy(&new_node->client_addr, &client_addr, sizeof(client_addr));
-        pthread_create(&new_node->thread_id, NULL, client_thread_func, new_node);
-        SLIST_INSERT_HEAD(&g_thread_list_head, new_node, entries);
+    if (mode == SERVER_MODE_EPOLL) {
+        fcntl(g_socketfd, F_SETFL, fcntl(g_socketfd, F_GETFL) | O_NONBLOCK);
+        if (reactor_run(g_socketfd, count) != 0)
+            syslog(LOG_ERR, "epoll mode failed to start");
+    } else if (mode == SERVER_MODE_POOL) {
+        if (count == 0) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            count = cpus > 0 ? (unsigned int)cpus : 1;
+        }
+        if (threadpool_start(count) != 0) {
+            syslog(LOG_ERR, "pool mode failed to start");
+        } else {
+            pool_mode_run();
+            threadpool_drain();
+        }
+    } else if (mode == SERVER_MODE_URING) {
+        if (uring_run(g_socketfd, count) != 0) {
+            syslog(LOG_WARNING, "io_uring mode unavailable, using thread per connection");
+            thread_mode_run();
+        }
+    } else {
+        thread_mode_run();
     }
 
+    if (g_exit_signal)
+        syslog(LOG_INFO, "Caught signal, exiting");
+
+    /* Graceful drain: every client thread has been joined at this point */
+    g_exit_flag = 1;
+    pthread_mutex_lock(&g_exit_mutex);
+    pthread_cond_broadcast(&g_exit_cond);
+    pthread_mutex_unlock(&g_exit_mutex);
+#ifndef USE_AESD_CHAR_DEVICE
+    pthread_join(g_timer_thread, NULL);
+#endif
+    writer_stop();
+#ifndef USE_AESD_CHAR_DEVICE
+    for (unsigned int shard = 0; shard < datafile_shards(); shard++)
+        remove(datafile_path(shard));
+#endif
+    datafile_cleanup();
+    applog_cleanup();
+
     close(g_socketfd);
+    close(g_wakeup_fd);
     closelog();
     return 0;
 }
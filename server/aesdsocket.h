@@ -0,0 +1,214 @@
+/****************************************************************************
+ * @file aesdsocket.h
+ * @brief Shared definitions for the aesdsocket server modes
+ * @author Parth Varsani
+ ****************************************************************************/
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#define SERVER_PORT "9000"
+
+#ifdef USE_AESD_CHAR_DEVICE
+    #define DATAFILE_PATH "/dev/aesdchar"
+#else
+    #define DATAFILE_PATH "/var/tmp/aesdsocketdata"
+#endif
+
+#define BUF_MAXLEN 1024
+
+/* Most data file shards selectable with -s, one per aesdchar minor */
+#define DATAFILE_MAX_SHARDS 256
+
+#define AESDCHAR_SEEKTO_CMD "AESDCHAR_IOCSEEKTO:"
+
+/**
+ * "AESDSOCKET_ECHO:incremental" switches a client to receiving only the bytes
+ * appended since its previous echo, "AESDSOCKET_ECHO:full" switches back
+ */
+#define AESDSOCKET_ECHO_CMD "AESDSOCKET_ECHO:"
+
+/**
+ * How accepted connections are serviced, selected with -m at startup
+ */
+enum server_mode {
+    SERVER_MODE_THREAD,     /* one thread per connection (default) */
+    SERVER_MODE_POOL,       /* fixed worker pool fed by a job queue */
+    SERVER_MODE_EPOLL,      /* edge-triggered epoll reactor(s) */
+    SERVER_MODE_URING,      /* single io_uring event loop */
+};
+
+extern volatile sig_atomic_t g_exit_flag;
+
+/**
+ * eventfd written by the signal handler so event loops blocked in
+ * epoll_wait() notice the shutdown request
+ */
+extern int g_wakeup_fd;
+
+/* aesdsocket.c */
+void client_serve(int client_fd, const struct sockaddr_in *client_addr);
+
+/**
+ * When appended data is forced to storage, selected with -y at startup.
+ * Only the /var/tmp build has storage to sync; the aesdchar device keeps its
+ * data in memory and always runs with DURABILITY_NONE.
+ */
+enum datafile_durability {
+    DURABILITY_NONE,        /* left to the kernel's writeback (default) */
+    DURABILITY_PERIODIC,    /* fdatasync() by the timer thread every DATAFILE_SYNC_INTERVAL */
+    DURABILITY_BATCH,       /* fdatasync() after each append, or each -g group commit */
+    DURABILITY_DSYNC,       /* O_DSYNC, every write() waits for storage */
+};
+
+/* Seconds between DURABILITY_PERIODIC syncs, a divisor of the timestamp interval */
+#define DATAFILE_SYNC_INTERVAL 1
+
+/**
+ * Progress of one echo of the data file to a client
+ */
+struct datafile_echo {
+    bool active;
+    unsigned int shard;     /* data file being echoed */
+    int seek_fd;            /* AESDCHAR_IOCSEEKTO descriptor, or -1 for the whole file */
+    off_t offset;           /* next offset in the shared descriptor when seek_fd is -1 */
+    size_t remaining;       /* bytes left to echo, fixed at the start so the echo ends */
+#ifdef USE_AESD_CHAR_DEVICE
+    int pipe_fd[2];         /* splice() staging pipe */
+    size_t piped;           /* bytes waiting in the pipe */
+#endif
+    bool use_copy;          /* zero-copy unsupported: read()/send() through tx_buf */
+    size_t tx_len;
+    size_t tx_sent;
+    char tx_buf[BUF_MAXLEN];
+};
+
+/**
+ * An append written outside datafile_appendv() at an offset reserved with
+ * datafile_reserve(), e.g. by the io_uring engine.  Appends may complete out
+ * of order; each becomes visible to echoes and is mirrored into the append
+ * log only once every reservation before it has completed, so both follow
+ * the file order.
+ */
+struct datafile_reservation {
+    const char *data;                   /* appended bytes, valid until committed */
+    size_t len;
+    off_t offset;                       /* where to write (ignored by /dev/aesdchar) */
+    bool done;                          /* datafile_complete() was called */
+    bool owned;                         /* copy made by datafile_writev(), freed on commit */
+    struct datafile_reservation *next;
+};
+
+/**
+ * A client's read position in the in-memory append log
+ */
+struct applog_cursor {
+    struct applog *log;             /* log of the client's data file shard */
+    struct applog_segment *seg;     /* referenced segment containing pos */
+    size_t pos;                     /* next log position to send */
+    size_t end;                     /* log position marked for the current echo */
+    bool overrun;                   /* cut off the log for falling behind */
+    struct applog_cursor *next;     /* the log's next open cursor */
+};
+
+/**
+ * Growable per-connection receive buffer, framed into newline-terminated
+ * packets by linebuf_next_batch()
+ */
+struct linebuf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+/* Longest partial line buffered before it is appended unterminated */
+#define LINEBUF_MAX_LEN (1024 * 1024)
+
+/* Most data lines appended by one writev() */
+#define LINEBUF_MAX_IOV 64
+
+enum linebuf_batch_kind {
+    LINEBUF_BATCH_NONE,     /* no complete packet buffered yet */
+    LINEBUF_BATCH_DATA,     /* consecutive data lines to append, then echo */
+    LINEBUF_BATCH_COMMAND,  /* a single AESDCHAR_IOCSEEKTO/AESDSOCKET_ECHO line */
+};
+
+struct linebuf_batch {
+    struct iovec iov[LINEBUF_MAX_IOV];
+    int iovcnt;
+    size_t len;             /* total bytes in iov */
+    bool terminated;        /* ends with a newline, so an echo is due */
+};
+
+/* linebuf.c */
+void linebuf_init(struct linebuf *lb);
+void linebuf_free(struct linebuf *lb);
+char *linebuf_space(struct linebuf *lb, size_t *avail);
+void linebuf_commit(struct linebuf *lb, size_t len);
+enum linebuf_batch_kind linebuf_next_batch(struct linebuf *lb, struct linebuf_batch *batch,
+                                           bool flush);
+void linebuf_consume(struct linebuf *lb, size_t len);
+
+/* applog.c */
+int applog_init(unsigned int logs);
+void applog_cleanup(void);
+int applog_append(unsigned int log, const char *buf, size_t len);
+void applog_cursor_init(struct applog_cursor *cursor, unsigned int log);
+void applog_cursor_release(struct applog_cursor *cursor);
+int applog_cursor_mark(struct applog_cursor *cursor);
+const char *applog_cursor_peek(struct applog_cursor *cursor, size_t *len);
+void applog_cursor_advance(struct applog_cursor *cursor, size_t len);
+int applog_cursor_send(struct applog_cursor *cursor, int client_fd);
+int applog_echo_command(const char *buf, size_t len);
+
+/* datafile.c */
+int datafile_init(unsigned int shards, enum datafile_durability durability);
+void datafile_cleanup(void);
+unsigned int datafile_shards(void);
+const char *datafile_path(unsigned int shard);
+unsigned int datafile_shard(const struct sockaddr_in *addr);
+int datafile_append(unsigned int shard, const char *buf, size_t len);
+int datafile_appendv(unsigned int shard, const struct iovec *iov, int iovcnt);
+int datafile_writev(unsigned int shard, const struct iovec *iov, int iovcnt);
+enum datafile_durability datafile_durability(void);
+int datafile_sync(unsigned int shard);
+int datafile_sync_batch(unsigned int shard);
+void datafile_sync_periodic(void);
+void datafile_reserve(unsigned int shard, struct datafile_reservation *res, const char *data,
+                      size_t len);
+struct datafile_reservation *datafile_complete(unsigned int shard,
+                                               struct datafile_reservation *res, bool written);
+off_t datafile_committed(unsigned int shard);
+int datafile_is_seekto(const char *buf, size_t len);
+int datafile_open_seekto(unsigned int shard, const char *buf, size_t len);
+void datafile_echo_start(struct datafile_echo *echo, unsigned int shard, int seek_fd);
+int datafile_echo_continue(struct datafile_echo *echo, int client_fd);
+void datafile_echo_end(struct datafile_echo *echo);
+void datafile_echo(int client_fd, unsigned int shard, int seek_fd);
+
+/* writer.c */
+int writer_start(void);
+void writer_stop(void);
+bool writer_enabled(void);
+int writer_append(unsigned int shard, const struct iovec *iov, int iovcnt);
+
+/* threadpool.c */
+int threadpool_start(unsigned int workers);
+int threadpool_submit(int client_fd, const struct sockaddr_in *client_addr);
+void threadpool_drain(void);
+
+/* reactor.c */
+int reactor_run(int listen_fd, unsigned int reactors);
+
+/* uring.c */
+int uring_run(int listen_fd, unsigned int max_conns);
+
+#endif /* AESDSOCKET_H */
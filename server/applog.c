@@ -0,0 +1,310 @@
+/****************************************************************************
+ * @file applog.c
+ * @brief In-memory append-only log mirroring the aesdsocket data file
+ * @author Parth Varsani
+ *
+ * - While any client is in incremental echo mode, appends to DATAFILE_PATH
+ *   are also copied into a chain of fixed-size segments, so those clients
+ *   can be sent only the bytes appended since their previous echo instead
+ *   of the whole file; with no cursor open nothing is copied
+ * - Segments are reference counted: the log holds the tail, every segment
+ *   holds its successor and every client cursor holds the segment it is
+ *   reading, so segments behind the slowest cursor are freed automatically
+ * - A cursor that falls more than APPLOG_MAX_LAG behind the tail is cut off
+ *   the chain, keeping only the segment it holds, so a client that stops
+ *   reading cannot pin the log; its next echo falls back to the whole file
+ * - Bytes below a segment's published length never change, so readers send
+ *   straight from segment memory without taking the log lock
+ * - Each data file shard has its own log, selected by the shard index
+ ****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "aesdsocket.h"
+
+#define APPLOG_SEGMENT_SIZE (64 * 1024)
+
+/* Log bytes a cursor may fall behind the tail before it is cut off */
+#define APPLOG_MAX_LAG (64 * APPLOG_SEGMENT_SIZE)
+
+struct applog_segment {
+    atomic_uint refs;
+    size_t base;                                /* log position of data[0] */
+    atomic_size_t len;                          /* bytes published in data */
+    _Atomic(struct applog_segment *) next;
+    char data[APPLOG_SEGMENT_SIZE];
+};
+
+struct applog {
+    pthread_mutex_t lock;       /* serializes appends, tail lookups and cursor steps */
+    struct applog_segment *tail;
+    struct applog_cursor *cursors;  /* open cursors, linked through cursor->next */
+    atomic_uint ncursors;       /* appends are only copied while non-zero */
+};
+
+static struct applog *g_applogs;
+static unsigned int g_applog_count;
+
+static struct applog_segment *segment_alloc(size_t base) {
+    struct applog_segment *seg = malloc(sizeof(*seg));
+    if (!seg)
+        return NULL;
+    atomic_init(&seg->refs, 1);
+    seg->base = base;
+    atomic_init(&seg->len, 0);
+    atomic_init(&seg->next, NULL);
+    return seg;
+}
+
+static void segment_get(struct applog_segment *seg) {
+    atomic_fetch_add_explicit(&seg->refs, 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Drop a reference, freeing the segment and releasing its successor
+ * when it was the last one.
+ */
+static void segment_put(struct applog_segment *seg) {
+    while (seg && atomic_fetch_sub_explicit(&seg->refs, 1, memory_order_acq_rel) == 1) {
+        struct applog_segment *next = atomic_load_explicit(&seg->next, memory_order_acquire);
+        free(seg);
+        seg = next;
+    }
+}
+
+/**
+ * @brief Create one empty log per data file shard.
+ * @return 0 on success, -1 when out of memory
+ */
+int applog_init(unsigned int logs) {
+    g_applogs = calloc(logs, sizeof(*g_applogs));
+    if (!g_applogs)
+        return -1;
+    g_applog_count = logs;
+    for (unsigned int i = 0; i < logs; i++) {
+        pthread_mutex_init(&g_applogs[i].lock, NULL);
+        g_applogs[i].tail = segment_alloc(0);
+        if (!g_applogs[i].tail) {
+            applog_cleanup();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void applog_cleanup(void) {
+    for (unsigned int i = 0; i < g_applog_count; i++) {
+        pthread_mutex_lock(&g_applogs[i].lock);
+        segment_put(g_applogs[i].tail);
+        g_applogs[i].tail = NULL;
+        pthread_mutex_unlock(&g_applogs[i].lock);
+        pthread_mutex_destroy(&g_applogs[i].lock);
+    }
+    free(g_applogs);
+    g_applogs = NULL;
+    g_applog_count = 0;
+}
+
+/**
+ * @brief Cut every cursor of @param applog that is more than APPLOG_MAX_LAG
+ * behind log position @param base off the chain: it keeps the segment it
+ * may be sending from, the successors nobody else holds are freed.  Called
+ * with the lock held.
+ */
+static void applog_cut_overrun(struct applog *applog, size_t base) {
+    for (struct applog_cursor *cursor = applog->cursors; cursor; cursor = cursor->next) {
+        if (cursor->overrun || !cursor->seg || base - cursor->seg->base <= APPLOG_MAX_LAG)
+            continue;
+        struct applog_segment *next = atomic_exchange_explicit(&cursor->seg->next, NULL,
+                                                               memory_order_acq_rel);
+        cursor->overrun = true;
+        segment_put(next);
+    }
+}
+
+/**
+ * @brief Append @param len bytes to log @param log, if any cursor is open.
+ * @return 0 on success, -1 if a segment could not be allocated
+ */
+int applog_append(unsigned int log, const char *buf, size_t len) {
+    struct applog *applog = &g_applogs[log];
+    int rc = 0;
+
+    /* A cursor opened after this check starts past these bytes anyway */
+    if (atomic_load_explicit(&applog->ncursors, memory_order_relaxed) == 0)
+        return 0;
+
+    pthread_mutex_lock(&applog->lock);
+    while (len > 0 && applog->tail) {
+        struct applog_segment *tail = applog->tail;
+        size_t used = atomic_load_explicit(&tail->len, memory_order_relaxed);
+
+        if (used == APPLOG_SEGMENT_SIZE) {
+            struct applog_segment *seg = segment_alloc(tail->base + used);
+            if (!seg) {
+                syslog(LOG_ERR, "Out of memory for append log segment");
+                rc = -1;
+                break;
+            }
+            /* One reference for the link from tail, one for applog->tail */
+            segment_get(seg);
+            atomic_store_explicit(&tail->next, seg, memory_order_release);
+            applog->tail = seg;
+            segment_put(tail);
+            applog_cut_overrun(applog, seg->base);
+            continue;
+        }
+
+        size_t chunk = APPLOG_SEGMENT_SIZE - used;
+        if (chunk > len)
+            chunk = len;
+        memcpy(tail->data + used, buf, chunk);
+        atomic_store_explicit(&tail->len, used + chunk, memory_order_release);
+        buf += chunk;
+        len -= chunk;
+    }
+    pthread_mutex_unlock(&applog->lock);
+    return rc;
+}
+
+/**
+ * @brief Position @param cursor at the current end of log @param log.
+ */
+void applog_cursor_init(struct applog_cursor *cursor, unsigned int log) {
+    cursor->log = &g_applogs[log];
+    cursor->overrun = false;
+    pthread_mutex_lock(&cursor->log->lock);
+    cursor->next = cursor->log->cursors;
+    cursor->log->cursors = cursor;
+    atomic_fetch_add_explicit(&cursor->log->ncursors, 1, memory_order_relaxed);
+    cursor->seg = cursor->log->tail;
+    if (cursor->seg) {
+        segment_get(cursor->seg);
+        cursor->pos = cursor->seg->base + atomic_load_explicit(&cursor->seg->len, memory_order_relaxed);
+    } else {
+        cursor->pos = 0;
+    }
+    cursor->end = cursor->pos;
+    pthread_mutex_unlock(&cursor->log->lock);
+}
+
+void applog_cursor_release(struct applog_cursor *cursor) {
+    struct applog *applog = cursor->log;
+
+    pthread_mutex_lock(&applog->lock);
+    for (struct applog_cursor **link = &applog->cursors; *link; link = &(*link)->next) {
+        if (*link == cursor) {
+            *link = cursor->next;
+            break;
+        }
+    }
+    atomic_fetch_sub_explicit(&applog->ncursors, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&applog->lock);
+    segment_put(cursor->seg);
+    cursor->seg = NULL;
+}
+
+/**
+ * @brief Mark everything appended so far as due for the next echo.
+ * @return 0 on success, -1 if the cursor fell more than APPLOG_MAX_LAG
+ *      behind and was released (logged): echo the whole file instead
+ */
+int applog_cursor_mark(struct applog_cursor *cursor) {
+    struct applog *applog = cursor->log;
+    bool overrun;
+
+    pthread_mutex_lock(&applog->lock);
+    overrun = cursor->overrun;
+    if (applog->tail && !overrun)
+        cursor->end = applog->tail->base + atomic_load_explicit(&applog->tail->len, memory_order_relaxed);
+    pthread_mutex_unlock(&applog->lock);
+
+    if (overrun) {
+        syslog(LOG_WARNING, "Incremental echo fell more than %d KiB behind, "
+               "echoing the whole file", APPLOG_MAX_LAG / 1024);
+        applog_cursor_release(cursor);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Find the next contiguous run of unsent bytes up to the mark.
+ * @param len set to the number of bytes available at the returned pointer
+ * @return a pointer into segment memory, or NULL once the mark is reached
+ */
+const char *applog_cursor_peek(struct applog_cursor *cursor, size_t *len) {
+    while (cursor->seg && cursor->pos < cursor->end) {
+        struct applog_segment *seg = cursor->seg;
+        size_t offset = cursor->pos - seg->base;
+        size_t published = atomic_load_explicit(&seg->len, memory_order_acquire);
+
+        if (offset < published) {
+            size_t avail = published - offset;
+            if (avail > cursor->end - cursor->pos)
+                avail = cursor->end - cursor->pos;
+            *len = avail;
+            return seg->data + offset;
+        }
+
+        /* Segment exhausted: step to its successor, unless the cursor was cut off */
+        pthread_mutex_lock(&cursor->log->lock);
+        struct applog_segment *next = atomic_load_explicit(&seg->next, memory_order_acquire);
+        if (next) {
+            segment_get(next);
+            cursor->seg = next;
+        }
+        pthread_mutex_unlock(&cursor->log->lock);
+        if (!next)
+            break;
+        segment_put(seg);
+    }
+    *len = 0;
+    return NULL;
+}
+
+void applog_cursor_advance(struct applog_cursor *cursor, size_t len) {
+    cursor->pos += len;
+}
+
+/**
+ * @brief Send the marked bytes to @param client_fd.
+ * @return 0 when everything up to the mark was sent, 1 if a non-blocking
+ *      socket is full, -1 on error
+ */
+int applog_cursor_send(struct applog_cursor *cursor, int client_fd) {
+    const char *data;
+    size_t len;
+
+    while ((data = applog_cursor_peek(cursor, &len)) != NULL) {
+        ssize_t sent = send(client_fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        applog_cursor_advance(cursor, sent);
+    }
+    return 0;
+}
+
+/**
+ * @brief Parse an "AESDSOCKET_ECHO:full|incremental" command.
+ * @return -1 if @param buf is not an echo mode command, otherwise 1 for
+ *      incremental echoes and 0 for full-file echoes
+ */
+int applog_echo_command(const char *buf, size_t len) {
+    size_t cmd_len = strlen(AESDSOCKET_ECHO_CMD);
+
+    if (len < cmd_len || strncmp(buf, AESDSOCKET_ECHO_CMD, cmd_len) != 0)
+        return -1;
+    buf += cmd_len;
+    len -= cmd_len;
+    return len >= strlen("incremental") && strncmp(buf, "incremental", strlen("incremental")) == 0;
+}
@@ -0,0 +1,331 @@
+/**
+ * @file aesdsocket_read_bench.c
+ * @brief Concurrent echo readers against a writer for a running aesdsocket
+ *
+ * Grows the data file to a preload size, then runs 1, 2, 4, ... reader
+ * threads up to -r while one writer connection keeps appending lines in
+ * incremental echo mode.  Each reader connects, sends one short line, shuts
+ * down its sending side and reads the whole-file echo until the server
+ * closes, over and over.  Reports the echoes and echoed MiB per second and
+ * the lines per second the writer got stored alongside them.
+ *
+ * An echo must never contain a NUL byte, which is what a reader would see of
+ * a range reserved for an append that has not landed yet, so those are
+ * counted as bad bytes.
+ *
+ * Build and run from server/ with aesdsocket listening:
+ *     gcc -O2 -Wall -pthread bench/aesdsocket_read_bench.c -o aesdsocket_read_bench
+ *     ./aesdsocket_read_bench [-a address] [-p port] [-s seconds] [-r readers] [-k KiB] [-n]
+ * -k is the preload size (default 4096), -n runs without the writer.  Start
+ * aesdsocket with enough workers for every connection (e.g. -m pool -n 16).
+ *
+ * @author Parth Varsani
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define RECV_BUF_LEN (64 * 1024)
+
+/* Lines the writer appends are "write NNNNNNNN" padded to WRITE_LINE_LEN */
+#define WRITE_LINE_LEN 100
+
+/* Lines appended to reach the preload size */
+#define PRELOAD_LINE_LEN 1024
+
+static const char ECHO_INCREMENTAL[] = "AESDSOCKET_ECHO:incremental\n";
+
+static struct sockaddr_in g_addr;
+static atomic_bool g_stop;
+static atomic_ullong g_echoes;
+static atomic_ullong g_bytes;
+static atomic_ullong g_bad;
+static atomic_ullong g_lines;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief Connect to aesdsocket with a receive timeout, so a stalled echo
+ * shows up as an error instead of a hang.
+ * @return the socket, or -1 (reported)
+ */
+static int server_connect(void)
+{
+    struct timeval timeout = { .tv_sec = 5 };
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(fd, (struct sockaddr *)&g_addr, sizeof(g_addr)) != 0) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("send");
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Switch @param fd to incremental echoes.  The server only recognises
+ * the command as a packet of its own, so give it time to arrive alone.
+ */
+static int echo_incremental(int fd)
+{
+    if (send_all(fd, ECHO_INCREMENTAL, strlen(ECHO_INCREMENTAL)) != 0)
+        return -1;
+    usleep(100 * 1000);
+    return 0;
+}
+
+/**
+ * @brief Receive until @param fd has delivered @param want bytes in total
+ * since @param got was zero.
+ */
+static int recv_until(int fd, char *buf, unsigned long long *got, unsigned long long want)
+{
+    while (*got < want) {
+        ssize_t n = recv(fd, buf, RECV_BUF_LEN, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            fprintf(stderr, "recv: %s\n", n ? strerror(errno) : "connection closed");
+            return -1;
+        }
+        *got += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Append at least @param kib KiB so echoes have something to send.
+ */
+static int preload(unsigned long kib)
+{
+    char *buf = malloc(RECV_BUF_LEN);
+    char line[PRELOAD_LINE_LEN];
+    unsigned long long sent = 0, got = 0;
+    int fd = server_connect();
+    int rc = -1;
+
+    if (fd < 0 || !buf)
+        goto out;
+    if (echo_incremental(fd) != 0)
+        goto out;
+    memset(line, 'p', sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\n';
+    for (unsigned long i = 0; i < kib; i++) {
+        if (send_all(fd, line, sizeof(line)) != 0)
+            goto out;
+        sent += sizeof(line);
+        /* Wait for our own lines every 64 so the echoes cannot pile up */
+        if ((i + 1) % 64 == 0 && recv_until(fd, buf, &got, sent) != 0)
+            goto out;
+    }
+    rc = recv_until(fd, buf, &got, sent);
+out:
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+    return rc;
+}
+
+static void *reader_thread(void *arg)
+{
+    char *buf = malloc(RECV_BUF_LEN);
+    (void)arg;
+
+    if (!buf)
+        return NULL;
+
+    while (!atomic_load_explicit(&g_stop, memory_order_relaxed)) {
+        unsigned long long bytes = 0, bad = 0;
+        int fd = server_connect();
+        ssize_t n;
+
+        if (fd < 0)
+            break;
+        if (send_all(fd, "r\n", 2) != 0) {
+            close(fd);
+            break;
+        }
+        shutdown(fd, SHUT_WR);
+        while ((n = recv(fd, buf, RECV_BUF_LEN, 0)) > 0) {
+            bytes += n;
+            for (const char *p = buf; (p = memchr(p, '\0', buf + n - p)) != NULL; p++)
+                bad++;
+        }
+        close(fd);
+        if (n < 0) {
+            perror("recv");
+            break;
+        }
+        atomic_fetch_add_explicit(&g_bytes, bytes, memory_order_relaxed);
+        atomic_fetch_add_explicit(&g_bad, bad, memory_order_relaxed);
+        atomic_fetch_add_explicit(&g_echoes, 1, memory_order_relaxed);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+/**
+ * @brief Append lines one at a time, each waiting for its incremental echo.
+ * Readers' lines are echoed too, so the byte count only bounds the wait.
+ */
+static void *writer_thread(void *arg)
+{
+    char *buf = malloc(RECV_BUF_LEN);
+    char line[WRITE_LINE_LEN];
+    unsigned long long sent = 0, got = 0;
+    unsigned long seq = 0;
+    int fd = server_connect();
+    (void)arg;
+
+    if (fd < 0 || !buf || echo_incremental(fd) != 0)
+        goto out;
+
+    memset(line, 'w', sizeof(line));
+    line[sizeof(line) - 1] = '\n';
+    while (!atomic_load_explicit(&g_stop, memory_order_relaxed)) {
+        int len = snprintf(line, sizeof(line), "write %08lu", seq++ % 100000000ul);
+
+        line[len] = ' ';
+        if (send_all(fd, line, sizeof(line)) != 0)
+            break;
+        sent += sizeof(line);
+        if (recv_until(fd, buf, &got, sent) != 0)
+            break;
+        atomic_fetch_add_explicit(&g_lines, 1, memory_order_relaxed);
+    }
+
+out:
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    const char *address = "127.0.0.1";
+    unsigned long preload_kib = 4096;
+    long max_readers = 8;
+    double seconds = 2.0;
+    bool with_writer = true;
+    int port = 9000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:p:s:r:k:n")) != -1) {
+        switch (opt) {
+        case 'a':
+            address = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 's':
+            seconds = atof(optarg);
+            break;
+        case 'r':
+            max_readers = atol(optarg);
+            break;
+        case 'k':
+            preload_kib = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            with_writer = false;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-a address] [-p port] [-s seconds] [-r readers] "
+                    "[-k KiB] [-n]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    g_addr.sin_family = AF_INET;
+    g_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address, &g_addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid address %s\n", address);
+        return 1;
+    }
+    if (preload(preload_kib) != 0)
+        return 1;
+
+    printf("%8s %10s %12s %14s %10s\n", "readers", "echoes/s", "MiB/s", "writes/s",
+           "bad bytes");
+    for (long readers = 1; readers <= (max_readers > 0 ? max_readers : 1); readers *= 2) {
+        pthread_t threads[readers];
+        pthread_t writer;
+        uint64_t start, elapsed;
+
+        atomic_store(&g_stop, false);
+        atomic_store(&g_echoes, 0);
+        atomic_store(&g_bytes, 0);
+        atomic_store(&g_bad, 0);
+        atomic_store(&g_lines, 0);
+
+        if (with_writer && pthread_create(&writer, NULL, writer_thread, NULL) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+        start = now_ns();
+        for (long i = 0; i < readers; i++) {
+            if (pthread_create(&threads[i], NULL, reader_thread, NULL) != 0) {
+                perror("pthread_create");
+                return 1;
+            }
+        }
+
+        usleep((useconds_t)(seconds * 1e6));
+        atomic_store(&g_stop, true);
+        for (long i = 0; i < readers; i++)
+            pthread_join(threads[i], NULL);
+        elapsed = now_ns() - start;
+        if (with_writer)
+            pthread_join(writer, NULL);
+
+        printf("%8ld %10.0f %12.1f %14.0f %10llu\n", readers,
+               atomic_load(&g_echoes) * 1e9 / elapsed,
+               atomic_load(&g_bytes) * 1e9 / elapsed / (1024 * 1024),
+               atomic_load(&g_lines) * 1e9 / elapsed,
+               atomic_load(&g_bad));
+    }
+    return atomic_load(&g_bad) != 0;
+}
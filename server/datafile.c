@@ -0,0 +1,699 @@
+/****************************************************************************
+ * @file datafile.c
+ * @brief Access to the aesdsocket data file shared by all server modes
+ * @author Parth Varsani
+ *
+ * - DATAFILE_PATH is opened once at startup for writing and once for
+ *   reading; appends take the file lock exclusively, echo reads take it
+ *   shared so any number of echoes proceed in parallel
+ * - With -s COUNT clients are sharded by address across COUNT independent
+ *   files (/dev/aesdchar0..COUNT-1 in the driver build), each with its own
+ *   descriptors, lock and append log, so appends to different shards never
+ *   contend; a single shard keeps using DATAFILE_PATH itself
+ * - Appends use pwrite() at the tracked end of the file in the /var/tmp build
+ *   (the driver appends regardless of offset in the /dev/aesdchar build) and
+ *   are mirrored into the in-memory append log in the same order; with -g
+ *   they are handed to the group commit writer thread instead
+ * - Appends issued asynchronously at offsets from datafile_reserve() are
+ *   committed in reservation order: echoes stop at the committed end seen
+ *   when they start and the append log is extended only up to it, so
+ *   neither sees a reserved range before it is written
+ * - The /var/tmp file is forced to storage according to the -y durability
+ *   level, and the time each sync takes is logged per shard at shutdown
+ * - Echoes the file back to clients without copying through userspace:
+ *   sendfile() from a descriptor kept open for the server lifetime in the
+ *   /var/tmp build, splice() through a pipe in the /dev/aesdchar build
+ *   (falling back to read()/send() if the driver lacks splice_read)
+ * - Opens /dev/aesdchar and applies AESDCHAR_IOCSEEKTO for seek commands
+ ****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include "aesdsocket.h"
+#include "../aesd-char-driver/aesd_ioctl.h"
+
+/* Largest amount moved per sendfile()/splice() call, bounded by the pipe size */
+#define ECHO_CHUNK (64 * 1024)
+
+/**
+ * Time spent forcing one shard to storage, by fdatasync() or, with
+ * DURABILITY_DSYNC, by the writes themselves
+ */
+struct datafile_sync_stats {
+    atomic_ulong count;
+    atomic_ullong total_ns;
+    atomic_ullong max_ns;
+};
+
+/**
+ * One shard of the data file
+ */
+struct datafile {
+    pthread_rwlock_t lock;      /* shared by echo reads, exclusive for appends */
+    int fd;                     /* read descriptor shared by every echo; only
+                                 * offset-taking calls use it */
+    int write_fd;
+    struct datafile_reservation *pending;       /* uncommitted appends, oldest first */
+    struct datafile_reservation **pending_tail;
+#ifndef USE_AESD_CHAR_DEVICE
+    off_t size;                 /* end of the file, where the next append goes */
+    off_t committed;            /* end of what echoes may read, every append below
+                                 * it has completed */
+    off_t synced_size;          /* size at the last periodic sync, timer thread only */
+    struct datafile_sync_stats sync_stats;
+#endif
+    char path[sizeof(DATAFILE_PATH) + 10];
+};
+
+static struct datafile *g_datafiles;
+static unsigned int g_datafile_count;
+static enum datafile_durability g_durability;
+
+#ifndef USE_AESD_CHAR_DEVICE
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sync_stats_add(struct datafile_sync_stats *stats, uint64_t ns) {
+    unsigned long long max = atomic_load_explicit(&stats->max_ns, memory_order_relaxed);
+
+    atomic_fetch_add_explicit(&stats->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->total_ns, ns, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&stats->max_ns, &max, ns,
+                                                              memory_order_relaxed,
+                                                              memory_order_relaxed))
+        ;
+}
+#endif
+
+/**
+ * @brief Open the shared read and write descriptors of @param shards data
+ * files, creating them if needed, to be kept as durable as @param durability.
+ * @return 0 on success, -1 on failure (logged)
+ */
+int datafile_init(unsigned int shards, enum datafile_durability durability) {
+    pthread_rwlockattr_t attr;
+
+#ifdef USE_AESD_CHAR_DEVICE
+    if (durability != DURABILITY_NONE)
+        syslog(LOG_WARNING, "%s has no storage to sync, ignoring -y", DATAFILE_PATH);
+    durability = DURABILITY_NONE;
+#endif
+    g_durability = durability;
+
+    g_datafiles = calloc(shards, sizeof(*g_datafiles));
+    if (!g_datafiles) {
+        syslog(LOG_ERR, "Out of memory for %u data files", shards);
+        return -1;
+    }
+    g_datafile_count = shards;
+
+    /* Echoes hold the lock per chunk and never recursively, so let a waiting
+     * append go ahead of newly arriving echoes instead of starving */
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (unsigned int i = 0; i < shards; i++) {
+        struct datafile *df = &g_datafiles[i];
+
+        pthread_rwlock_init(&df->lock, &attr);
+        df->fd = df->write_fd = -1;
+        df->pending_tail = &df->pending;
+        if (shards == 1)
+            snprintf(df->path, sizeof(df->path), "%s", DATAFILE_PATH);
+        else
+            snprintf(df->path, sizeof(df->path), "%s%u", DATAFILE_PATH, i);
+    }
+    pthread_rwlockattr_destroy(&attr);
+
+    for (unsigned int i = 0; i < shards; i++) {
+        struct datafile *df = &g_datafiles[i];
+
+#ifdef USE_AESD_CHAR_DEVICE
+        df->write_fd = open(df->path, O_WRONLY | O_CLOEXEC);
+        df->fd = open(df->path, O_RDONLY | O_CLOEXEC);
+#else
+        df->write_fd = open(df->path, O_WRONLY | O_CREAT | O_CLOEXEC |
+                            (durability == DURABILITY_DSYNC ? O_DSYNC : 0), 0644);
+        df->fd = open(df->path, O_RDONLY | O_CLOEXEC);
+#endif
+        if (df->write_fd < 0 || df->fd < 0) {
+            syslog(LOG_ERR, "Failed to open %s: %s", df->path, strerror(errno));
+            datafile_cleanup();
+            return -1;
+        }
+#ifndef USE_AESD_CHAR_DEVICE
+        df->size = lseek(df->write_fd, 0, SEEK_END);
+        if (df->size < 0)
+            df->size = 0;
+        df->synced_size = df->size;
+        df->committed = df->size;
+#endif
+    }
+    return 0;
+}
+
+void datafile_cleanup(void) {
+    for (unsigned int i = 0; i < g_datafile_count; i++) {
+        struct datafile *df = &g_datafiles[i];
+
+        if (df->fd >= 0)
+            close(df->fd);
+        if (df->write_fd >= 0)
+            close(df->write_fd);
+        pthread_rwlock_destroy(&df->lock);
+#ifndef USE_AESD_CHAR_DEVICE
+        unsigned long syncs = atomic_load(&df->sync_stats.count);
+        if (syncs)
+            syslog(LOG_INFO, "%s: %lu syncs, %.1f us average, %.1f us max", df->path, syncs,
+                   atomic_load(&df->sync_stats.total_ns) / 1e3 / syncs,
+                   atomic_load(&df->sync_stats.max_ns) / 1e3);
+#endif
+    }
+    free(g_datafiles);
+    g_datafiles = NULL;
+    g_datafile_count = 0;
+}
+
+enum datafile_durability datafile_durability(void) {
+    return g_durability;
+}
+
+unsigned int datafile_shards(void) {
+    return g_datafile_count;
+}
+
+/**
+ * @brief Path of data file @param shard, e.g. for engines opening it themselves.
+ */
+const char *datafile_path(unsigned int shard) {
+    return g_datafiles[shard].path;
+}
+
+/**
+ * @brief Pick the shard serving @param addr.  Only the address is hashed, so
+ * every connection from one host shares one history.
+ */
+unsigned int datafile_shard(const struct sockaddr_in *addr) {
+    uint32_t hash = ntohl(addr->sin_addr.s_addr) * 2654435761u;
+
+    return (unsigned int)(((uint64_t)hash * g_datafile_count) >> 32);
+}
+
+/**
+ * @brief Append @param len bytes of @param buf to data file @param shard.
+ * @return 0 on success, -1 on failure (logged)
+ */
+int datafile_append(unsigned int shard, const char *buf, size_t len) {
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+    return datafile_appendv(shard, &iov, 1);
+}
+
+/**
+ * @brief Append @param iovcnt buffers to the data file, e.g. every complete
+ * line of a receive batch, through the writer thread when group commit is
+ * enabled and with one writev() of its own otherwise.
+ * @return 0 on success, -1 on failure (logged)
+ */
+int datafile_appendv(unsigned int shard, const struct iovec *iov, int iovcnt) {
+    if (writer_enabled())
+        return writer_append(shard, iov, iovcnt);
+    if (datafile_writev(shard, iov, iovcnt) != 0)
+        return -1;
+    return datafile_sync_batch(shard);
+}
+
+/**
+ * @brief Publish the completed appends at the front of @param shard's
+ * reservation queue: mirror them into the append log and move the committed
+ * end up to the oldest append still in flight.  Called with the lock held.
+ * @return the committed reservations made by datafile_reserve(), in file order
+ */
+static struct datafile_reservation *datafile_commit_locked(unsigned int shard) {
+    struct datafile *df = &g_datafiles[shard];
+    struct datafile_reservation *committed = NULL;
+    struct datafile_reservation **tail = &committed;
+
+    while (df->pending && df->pending->done) {
+        struct datafile_reservation *res = df->pending;
+
+        df->pending = res->next;
+        if (res->data)
+            applog_append(shard, res->data, res->len);
+        if (res->owned) {
+            free(res);
+        } else {
+            res->next = NULL;
+            *tail = res;
+            tail = &res->next;
+        }
+    }
+    if (!df->pending)
+        df->pending_tail = &df->pending;
+#ifndef USE_AESD_CHAR_DEVICE
+    df->committed = df->pending ? df->pending->offset : df->size;
+#endif
+    return committed;
+}
+
+/**
+ * @brief Queue a copy of an append that completed while earlier reservations
+ * of @param df are still in flight, so it reaches the append log after them.
+ * Called with the lock held.
+ */
+static void datafile_pend_copy(struct datafile *df, const struct iovec *iov, int iovcnt,
+                               size_t len, off_t offset) {
+    struct datafile_reservation *res = malloc(sizeof(*res) + len);
+    char *data;
+
+    if (!res) {
+        syslog(LOG_ERR, "Out of memory, %zu bytes missing from the %s append log", len,
+               df->path);
+        return;
+    }
+    data = (char *)(res + 1);
+    res->data = data;
+    res->len = len;
+    res->offset = offset;
+    res->done = true;
+    res->owned = true;
+    res->next = NULL;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(data, iov[i].iov_base, iov[i].iov_len);
+        data += iov[i].iov_len;
+    }
+    *df->pending_tail = res;
+    df->pending_tail = &res->next;
+}
+
+/**
+ * @brief Write @param iovcnt buffers to the end of data file @param shard
+ * with one writev() and mirror them into its append log.
+ * @return 0 on success, -1 on failure (logged)
+ */
+int datafile_writev(unsigned int shard, const struct iovec *iov, int iovcnt) {
+    struct datafile *df = &g_datafiles[shard];
+    size_t len = 0;
+    int rc = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    pthread_rwlock_wrlock(&df->lock);
+#ifdef USE_AESD_CHAR_DEVICE
+    ssize_t written = writev(df->write_fd, iov, iovcnt);
+#else
+    uint64_t start = g_durability == DURABILITY_DSYNC ? monotonic_ns() : 0;
+    ssize_t written = pwritev(df->write_fd, iov, iovcnt, df->size);
+    if (g_durability == DURABILITY_DSYNC)
+        sync_stats_add(&df->sync_stats, monotonic_ns() - start);
+#endif
+    if (written != (ssize_t)len) {
+        syslog(LOG_ERR, "Failed to write %s: %s", df->path, strerror(errno));
+        rc = -1;
+    } else {
+        off_t offset = 0;
+#ifndef USE_AESD_CHAR_DEVICE
+        offset = df->size;
+        df->size += len;
+#endif
+        if (df->pending) {
+            datafile_pend_copy(df, iov, iovcnt, len, offset);
+        } else {
+            for (int i = 0; i < iovcnt; i++)
+                applog_append(shard, iov[i].iov_base, iov[i].iov_len);
+#ifndef USE_AESD_CHAR_DEVICE
+            df->committed = df->size;
+#endif
+        }
+    }
+    pthread_rwlock_unlock(&df->lock);
+    return rc;
+}
+
+/**
+ * @brief Flush data file @param shard to storage.  The aesdchar device keeps
+ * its data in memory, so there is nothing to flush in that build.
+ * @return 0 on success, -1 on failure (logged)
+ */
+int datafile_sync(unsigned int shard) {
+#ifndef USE_AESD_CHAR_DEVICE
+    struct datafile *df = &g_datafiles[shard];
+    uint64_t start = monotonic_ns();
+
+    if (fdatasync(df->write_fd) != 0) {
+        syslog(LOG_ERR, "Failed to sync %s: %s", df->path, strerror(errno));
+        return -1;
+    }
+    sync_stats_add(&df->sync_stats, monotonic_ns() - start);
+#else
+    (void)shard;
+#endif
+    return 0;
+}
+
+/**
+ * @brief Sync data file @param shard after a batch of appends was written,
+ * if the durability level asks for it.
+ * @return 0 on success, -1 on failure (logged)
+ */
+int datafile_sync_batch(unsigned int shard) {
+    return g_durability == DURABILITY_BATCH ? datafile_sync(shard) : 0;
+}
+
+/**
+ * @brief Sync every data file appended to since the previous call, for
+ * DURABILITY_PERIODIC.  Called from the timer thread only.
+ */
+void datafile_sync_periodic(void) {
+#ifndef USE_AESD_CHAR_DEVICE
+    for (unsigned int i = 0; i < g_datafile_count; i++) {
+        struct datafile *df = &g_datafiles[i];
+
+        pthread_rwlock_rdlock(&df->lock);
+        off_t size = df->size;
+        pthread_rwlock_unlock(&df->lock);
+        if (size != df->synced_size && datafile_sync(i) == 0)
+            df->synced_size = size;
+    }
+#endif
+}
+
+/**
+ * @brief Reserve room for @param len bytes of @param data at the end of data
+ * file @param shard, for an append issued outside datafile_appendv(), e.g. by
+ * the io_uring engine.  @param res->offset is set to where to write them;
+ * @param data must stay valid until @param res is committed.  Every
+ * reservation must be completed, even if the write is abandoned, before
+ * datafile_cleanup().
+ */
+void datafile_reserve(unsigned int shard, struct datafile_reservation *res, const char *data,
+                      size_t len) {
+    struct datafile *df = &g_datafiles[shard];
+
+    res->data = data;
+    res->len = len;
+    res->offset = 0;
+    res->done = false;
+    res->owned = false;
+    res->next = NULL;
+
+    pthread_rwlock_wrlock(&df->lock);
+#ifndef USE_AESD_CHAR_DEVICE
+    res->offset = df->size;
+    df->size += len;
+#endif
+    *df->pending_tail = res;
+    df->pending_tail = &res->next;
+    pthread_rwlock_unlock(&df->lock);
+}
+
+/**
+ * @brief Mark the append of reservation @param res as finished and commit
+ * every finished append no longer waiting for an earlier one.
+ * @param written false if the append failed or was abandoned, so its bytes
+ *      are not mirrored into the append log
+ * @return the committed reservations made by datafile_reserve(), linked
+ *      through next in file order, possibly without @param res when an
+ *      earlier append is still in flight and possibly with other callers'
+ */
+struct datafile_reservation *datafile_complete(unsigned int shard,
+                                               struct datafile_reservation *res, bool written) {
+    struct datafile *df = &g_datafiles[shard];
+    struct datafile_reservation *committed;
+
+    pthread_rwlock_wrlock(&df->lock);
+    res->done = true;
+    if (!written)
+        res->data = NULL;
+    committed = datafile_commit_locked(shard);
+    pthread_rwlock_unlock(&df->lock);
+    return committed;
+}
+
+/**
+ * @brief End of the data of file @param shard that echoes may read: reserved
+ * bytes past it may not have been written yet.  The driver stores each write
+ * whole, so in the /dev/aesdchar build this is the size of the device.
+ * @return the end offset, or -1 if the driver cannot report it (logged)
+ */
+off_t datafile_committed(unsigned int shard) {
+    struct datafile *df = &g_datafiles[shard];
+    off_t committed;
+
+#ifdef USE_AESD_CHAR_DEVICE
+    /* The shared fd is only ever used with explicit offsets, moving it is harmless */
+    committed = lseek(df->fd, 0, SEEK_END);
+    if (committed < 0)
+        syslog(LOG_ERR, "Failed to find the end of %s: %s", df->path, strerror(errno));
+#else
+    pthread_rwlock_rdlock(&df->lock);
+    committed = df->committed;
+    pthread_rwlock_unlock(&df->lock);
+#endif
+    return committed;
+}
+
+/**
+ * @brief Check whether a received packet is an AESDCHAR_IOCSEEKTO command.
+ */
+int datafile_is_seekto(const char *buf, size_t len) {
+#ifdef USE_AESD_CHAR_DEVICE
+    size_t cmd_len = strlen(AESDCHAR_SEEKTO_CMD);
+    return len >= cmd_len && strncmp(buf, AESDCHAR_SEEKTO_CMD, cmd_len) == 0;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * @brief Open the device of @param shard and apply an
+ * "AESDCHAR_IOCSEEKTO:X,Y" command.
+ * @return a file descriptor positioned at the requested command/offset, or
+ *      -1 if the command is malformed or the ioctl fails (logged)
+ */
+int datafile_open_seekto(unsigned int shard, const char *buf, size_t len) {
+#ifdef USE_AESD_CHAR_DEVICE
+    char params[64];
+    size_t cmd_len = strlen(AESDCHAR_SEEKTO_CMD);
+    size_t params_len = len - cmd_len;
+    struct aesd_seekto seekto;
+
+    if (params_len >= sizeof(params))
+        params_len = sizeof(params) - 1;
+    memcpy(params, buf + cmd_len, params_len);
+    params[params_len] = '\0';
+
+    if (sscanf(params, "%u,%u", &seekto.write_cmd, &seekto.write_cmd_offset) != 2) {
+        syslog(LOG_ERR, "Malformed %s command", AESDCHAR_SEEKTO_CMD);
+        return -1;
+    }
+
+    const char *path = g_datafiles[shard].path;
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Failed to open %s for ioctl: %s", path, strerror(errno));
+        return -1;
+    }
+
+    if (ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto) == -1) {
+        syslog(LOG_ERR, "ioctl AESDCHAR_IOCSEEKTO failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    (void)shard;
+    return -1;
+#endif
+}
+
+/**
+ * @brief Prepare @param echo to stream data file @param shard to a client.
+ * The echo stops at the end the file has now, so one that keeps pace with
+ * concurrent appends still finishes.
+ * @param seek_fd a descriptor from datafile_open_seekto() to echo from its
+ *      current position (ownership passes to @param echo), or -1 to echo the
+ *      whole file
+ */
+void datafile_echo_start(struct datafile_echo *echo, unsigned int shard, int seek_fd) {
+    memset(echo, 0, sizeof(*echo));
+    echo->shard = shard;
+    echo->seek_fd = seek_fd;
+
+    off_t end = datafile_committed(shard);
+    off_t start = seek_fd >= 0 ? lseek(seek_fd, 0, SEEK_CUR) : 0;
+    if (end < 0 || start < 0)
+        echo->remaining = SIZE_MAX;     /* no end to snapshot, read to end of file */
+    else
+        echo->remaining = end > start ? end - start : 0;
+#ifdef USE_AESD_CHAR_DEVICE
+    if (pipe2(echo->pipe_fd, O_CLOEXEC) < 0) {
+        syslog(LOG_ERR, "pipe2 failed: %s", strerror(errno));
+        echo->pipe_fd[0] = echo->pipe_fd[1] = -1;
+        echo->use_copy = true;
+    }
+#endif
+    echo->active = true;
+}
+
+/**
+ * @brief Release the resources held by an echo, finished or not.
+ */
+void datafile_echo_end(struct datafile_echo *echo) {
+    if (!echo->active)
+        return;
+    if (echo->seek_fd >= 0)
+        close(echo->seek_fd);
+#ifdef USE_AESD_CHAR_DEVICE
+    if (echo->pipe_fd[0] >= 0) {
+        close(echo->pipe_fd[0]);
+        close(echo->pipe_fd[1]);
+    }
+#endif
+    echo->active = false;
+}
+
+/**
+ * @brief Fallback echo through a userspace buffer, for drivers without splice_read.
+ */
+static int echo_copy(struct datafile_echo *echo, int client_fd, int src_fd, off_t *offset) {
+    struct datafile *df = &g_datafiles[echo->shard];
+
+    for (;;) {
+        if (echo->tx_sent == echo->tx_len) {
+            size_t count = echo->remaining < BUF_MAXLEN ? echo->remaining : BUF_MAXLEN;
+            ssize_t bytes_read;
+            if (count == 0)
+                return 0;
+            pthread_rwlock_rdlock(&df->lock);
+            if (offset) {
+                bytes_read = pread(src_fd, echo->tx_buf, count, *offset);
+                if (bytes_read > 0)
+                    *offset += bytes_read;
+            } else {
+                bytes_read = read(src_fd, echo->tx_buf, count);
+            }
+            pthread_rwlock_unlock(&df->lock);
+            if (bytes_read <= 0)
+                return bytes_read < 0 ? -1 : 0;
+            echo->remaining -= bytes_read;
+            echo->tx_len = bytes_read;
+            echo->tx_sent = 0;
+        }
+
+        ssize_t sent = send(client_fd, echo->tx_buf + echo->tx_sent,
+                            echo->tx_len - echo->tx_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        echo->tx_sent += sent;
+    }
+}
+
+/**
+ * @brief Move echo data to @param client_fd until the file is exhausted or
+ * the socket would block.  On a blocking socket this runs the whole echo.
+ * @return 0 when the echo is complete, 1 if a non-blocking socket is full,
+ *      -1 on error
+ */
+int datafile_echo_continue(struct datafile_echo *echo, int client_fd) {
+    struct datafile *df = &g_datafiles[echo->shard];
+    int src_fd = echo->seek_fd >= 0 ? echo->seek_fd : df->fd;
+    /* The shared fd is only ever used with explicit offsets */
+    off_t *offset = echo->seek_fd >= 0 ? NULL : &echo->offset;
+
+    if (echo->use_copy)
+        return echo_copy(echo, client_fd, src_fd, offset);
+
+    for (;;) {
+#ifdef USE_AESD_CHAR_DEVICE
+        if (echo->piped == 0) {
+            size_t count = echo->remaining < ECHO_CHUNK ? echo->remaining : ECHO_CHUNK;
+            if (count == 0)
+                return 0;
+            pthread_rwlock_rdlock(&df->lock);
+            ssize_t moved = splice(src_fd, offset, echo->pipe_fd[1], NULL, count,
+                                   SPLICE_F_MOVE);
+            pthread_rwlock_unlock(&df->lock);
+            if (moved == 0)
+                return 0;
+            if (moved < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EINVAL) {
+                    syslog(LOG_WARNING, "splice unsupported by %s, copying echo", df->path);
+                    echo->use_copy = true;
+                    return echo_copy(echo, client_fd, src_fd, offset);
+                }
+                syslog(LOG_ERR, "splice from %s failed: %s", df->path, strerror(errno));
+                return -1;
+            }
+            echo->remaining -= moved;
+            echo->piped = moved;
+        }
+
+        ssize_t sent = splice(echo->pipe_fd[0], NULL, client_fd, NULL, echo->piped,
+                              SPLICE_F_MOVE);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        echo->piped -= sent;
+#else
+        /* The remaining bytes lie below the committed end and never change,
+         * so no lock: a client that stops reading must not hold appends up
+         * behind a blocked sendfile() */
+        size_t count = echo->remaining < ECHO_CHUNK ? echo->remaining : ECHO_CHUNK;
+        ssize_t sent = count ? sendfile(client_fd, src_fd, offset, count) : 0;
+        if (sent == 0)
+            return 0;
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            if (errno == EINTR)
+                continue;
+            if (errno == EINVAL || errno == ENOSYS) {
+                echo->use_copy = true;
+                return echo_copy(echo, client_fd, src_fd, offset);
+            }
+            return -1;
+        }
+        echo->remaining -= sent;
+#endif
+    }
+}
+
+/**
+ * @brief Run a complete echo to a blocking client socket.
+ * @param shard, @param seek_fd as for datafile_echo_start()
+ */
+void datafile_echo(int client_fd, unsigned int shard, int seek_fd) {
+    struct datafile_echo echo;
+
+    datafile_echo_start(&echo, shard, seek_fd);
+    datafile_echo_continue(&echo, client_fd);
+    datafile_echo_end(&echo);
+}
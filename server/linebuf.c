@@ -0,0 +1,124 @@
+/****************************************************************************
+ * @file linebuf.c
+ * @brief Per-connection receive buffer with line framing for aesdsocket
+ * @author Parth Varsani
+ *
+ * - Received bytes accumulate in a growable buffer until they form complete
+ *   newline-terminated packets, so a packet larger than one recv() is still
+ *   appended to the data file in one go
+ * - linebuf_next_batch() hands out either one command line or every
+ *   consecutive complete data line as an iovec array, which the caller
+ *   appends with a single writev() and answers with a single echo
+ * - A partial line that reaches LINEBUF_MAX_LEN is handed out unframed so
+ *   one client cannot grow its buffer without bound
+ ****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "aesdsocket.h"
+
+/* Buffers grown past this are released once drained, idle connections stay small */
+#define LINEBUF_KEEP_LEN (64 * 1024)
+
+void linebuf_init(struct linebuf *lb) {
+    memset(lb, 0, sizeof(*lb));
+}
+
+void linebuf_free(struct linebuf *lb) {
+    free(lb->data);
+    memset(lb, 0, sizeof(*lb));
+}
+
+/**
+ * @brief Make room for at least BUF_MAXLEN more bytes.
+ * @param avail set to the number of bytes that can be received at the
+ *      returned pointer
+ * @return where to receive into, or NULL when out of memory (logged)
+ */
+char *linebuf_space(struct linebuf *lb, size_t *avail) {
+    if (lb->cap - lb->len < BUF_MAXLEN) {
+        size_t cap = lb->cap ? lb->cap : BUF_MAXLEN;
+        while (cap - lb->len < BUF_MAXLEN)
+            cap *= 2;
+        char *data = realloc(lb->data, cap);
+        if (!data) {
+            syslog(LOG_ERR, "Out of memory for receive buffer");
+            return NULL;
+        }
+        lb->data = data;
+        lb->cap = cap;
+    }
+    *avail = lb->cap - lb->len;
+    if (*avail > LINEBUF_MAX_LEN - lb->len)
+        *avail = LINEBUF_MAX_LEN - lb->len;
+    return lb->data + lb->len;
+}
+
+/**
+ * @brief Account for @param len bytes received into linebuf_space().
+ */
+void linebuf_commit(struct linebuf *lb, size_t len) {
+    lb->len += len;
+}
+
+/**
+ * @brief Find the next batch at the start of the buffer.
+ * Returns LINEBUF_BATCH_NONE while only a partial line is buffered, unless
+ * @param flush is set (connection closing) or the line hit LINEBUF_MAX_LEN,
+ * in which case the partial line is returned as unterminated data.
+ * The batch points into the buffer and stays valid until linebuf_consume().
+ */
+enum linebuf_batch_kind linebuf_next_batch(struct linebuf *lb, struct linebuf_batch *batch,
+                                           bool flush) {
+    size_t pos = 0;
+
+    batch->iovcnt = 0;
+    batch->len = 0;
+    batch->terminated = false;
+
+    while (pos < lb->len && batch->iovcnt < LINEBUF_MAX_IOV) {
+        char *line = lb->data + pos;
+        char *nl = memchr(line, '\n', lb->len - pos);
+        size_t line_len = nl ? (size_t)(nl - line) + 1 : lb->len - pos;
+
+        if (!nl && !flush && lb->len - pos < LINEBUF_MAX_LEN)
+            break;
+
+        if (applog_echo_command(line, line_len) >= 0 || datafile_is_seekto(line, line_len)) {
+            /* Commands are never merged with the data lines around them */
+            if (batch->iovcnt > 0)
+                break;
+            batch->iov[0].iov_base = line;
+            batch->iov[0].iov_len = line_len;
+            batch->iovcnt = 1;
+            batch->len = line_len;
+            return LINEBUF_BATCH_COMMAND;
+        }
+
+        batch->iov[batch->iovcnt].iov_base = line;
+        batch->iov[batch->iovcnt].iov_len = line_len;
+        batch->iovcnt++;
+        batch->len += line_len;
+        batch->terminated = nl != NULL;
+        pos += line_len;
+        if (!nl)
+            break;
+    }
+    return batch->iovcnt ? LINEBUF_BATCH_DATA : LINEBUF_BATCH_NONE;
+}
+
+/**
+ * @brief Drop @param len handled bytes from the front of the buffer.
+ */
+void linebuf_consume(struct linebuf *lb, size_t len) {
+    lb->len -= len;
+    if (lb->len > 0) {
+        memmove(lb->data, lb->data + len, lb->len);
+    } else if (lb->cap > LINEBUF_KEEP_LEN) {
+        free(lb->data);
+        lb->data = NULL;
+        lb->cap = 0;
+    }
+}
@@ -0,0 +1,290 @@
+/****************************************************************************
+ * @file reactor.c
+ * @brief Edge-triggered epoll event loop for aesdsocket (-m epoll)
+ * @author Parth Varsani
+ *
+ * - Runs one or more reactor threads, each with its own epoll instance
+ * - The listening socket is shared with EPOLLEXCLUSIVE so a new connection
+ *   wakes a single reactor
+ * - Every connection is a small non-blocking state machine: it is either
+ *   receiving packets or streaming an echo of the data file, never both;
+ *   echoes use the zero-copy datafile_echo_continue() and resume on EPOLLOUT
+ * - Received bytes are framed into lines in a per-connection buffer; each
+ *   batch of complete lines is appended with one write and echoed once
+ * - No per-client threads: idle connections only cost a struct epoll_conn
+ ****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "queue.h"
+#include "aesdsocket.h"
+
+#define REACTOR_MAX_EVENTS 64
+
+struct epoll_conn {
+    int fd;
+    struct sockaddr_in addr;
+    unsigned int shard;         /* data file shard picked from addr */
+    struct linebuf rx;          /* received bytes not yet framed into lines */
+    struct datafile_echo echo; /* active while an echo is in flight */
+    bool incremental;           /* AESDSOCKET_ECHO:incremental requested */
+    bool log_echo_pending;      /* incremental echo waiting for EPOLLOUT */
+    struct applog_cursor cursor;
+    LIST_ENTRY(epoll_conn) entries;
+};
+
+LIST_HEAD(epoll_conn_list, epoll_conn);
+
+struct reactor {
+    pthread_t thread_id;
+    int listen_fd;
+    int epfd;
+    struct epoll_conn_list conns;   /* open connections, closed on shutdown */
+};
+
+/* Distinguish the shared fds from connections in epoll_event.data.ptr */
+static char s_listen_token;
+static char s_wakeup_token;
+
+static void conn_close(struct epoll_conn *conn) {
+    syslog(LOG_INFO, "Closed connection from %s", inet_ntoa(conn->addr.sin_addr));
+    LIST_REMOVE(conn, entries);
+    datafile_echo_end(&conn->echo);
+    linebuf_free(&conn->rx);
+    if (conn->incremental)
+        applog_cursor_release(&conn->cursor);
+    /* close() also removes the fd from the epoll interest list */
+    close(conn->fd);
+    free(conn);
+}
+
+/**
+ * @brief Stream the pending echo until it completes or the socket is full.
+ * @return 0 when no echo is pending, 1 when waiting for EPOLLOUT,
+ *      -1 if the connection failed
+ */
+static int conn_flush_echo(struct epoll_conn *conn) {
+    if (conn->log_echo_pending) {
+        int rc = applog_cursor_send(&conn->cursor, conn->fd);
+        if (rc != 1)
+            conn->log_echo_pending = false;
+        return rc;
+    }
+    if (!conn->echo.active)
+        return 0;
+
+    int rc = datafile_echo_continue(&conn->echo, conn->fd);
+    if (rc != 1)
+        datafile_echo_end(&conn->echo);
+    return rc;
+}
+
+/**
+ * @brief Handle the next framed batch in the receive buffer: append it, or
+ * start an echo.
+ * @param flush also hand out a trailing partial line (peer closed)
+ * @return true if a batch was handled, false if no complete batch is buffered
+ */
+static bool conn_handle_batch(struct epoll_conn *conn, bool flush) {
+    struct linebuf_batch batch;
+    enum linebuf_batch_kind kind = linebuf_next_batch(&conn->rx, &batch, flush);
+
+    if (kind == LINEBUF_BATCH_NONE)
+        return false;
+
+    if (kind == LINEBUF_BATCH_COMMAND) {
+        const char *line = batch.iov[0].iov_base;
+        size_t line_len = batch.iov[0].iov_len;
+        int echo_mode = applog_echo_command(line, line_len);
+        if (echo_mode >= 0) {
+            if (echo_mode && !conn->incremental)
+                applog_cursor_init(&conn->cursor, conn->shard);
+            else if (!echo_mode && conn->incremental)
+                applog_cursor_release(&conn->cursor);
+            conn->incremental = echo_mode;
+        } else {
+            int fd = datafile_open_seekto(conn->shard, line, line_len);
+            if (fd >= 0)
+                datafile_echo_start(&conn->echo, conn->shard, fd);
+        }
+    } else if (datafile_appendv(conn->shard, batch.iov, batch.iovcnt) == 0 && batch.terminated) {
+        if (conn->incremental && applog_cursor_mark(&conn->cursor) != 0)
+            conn->incremental = false;
+        if (conn->incremental) {
+            conn->log_echo_pending = true;
+        } else {
+            datafile_echo_start(&conn->echo, conn->shard, -1);
+        }
+    }
+    linebuf_consume(&conn->rx, batch.len);
+    return true;
+}
+
+/**
+ * @brief Drive a connection until it would block in both directions.
+ * Edge-triggered notifications require draining the socket every time.
+ * @return 0 to keep the connection, -1 to close it
+ */
+static int conn_process(struct epoll_conn *conn) {
+    for (;;) {
+        int rc = conn_flush_echo(conn);
+        if (rc != 0)
+            return rc < 0 ? -1 : 0;
+
+        /* Lines already buffered are handled before reading more */
+        if (conn_handle_batch(conn, false))
+            continue;
+
+        size_t avail;
+        char *space = linebuf_space(&conn->rx, &avail);
+        if (!space)
+            return -1;
+
+        ssize_t rx_bytes = recv(conn->fd, space, avail, 0);
+        if (rx_bytes > 0) {
+            linebuf_commit(&conn->rx, rx_bytes);
+        } else if (rx_bytes == 0) {
+            while (conn_handle_batch(conn, true))
+                ;
+            return -1;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+static void reactor_accept(struct reactor *reactor) {
+    for (;;) {
+        struct sockaddr_in client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        int new_fd = accept4(reactor->listen_fd, (struct sockaddr *)&client_addr, &addr_len,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && !g_exit_flag)
+                syslog(LOG_ERR, "accept failed: %s", strerror(errno));
+            return;
+        }
+
+        struct epoll_conn *conn = calloc(1, sizeof(*conn));
+        if (!conn) {
+            syslog(LOG_ERR, "Out of memory for connection");
+            close(new_fd);
+            continue;
+        }
+        conn->fd = new_fd;
+        conn->addr = client_addr;
+        conn->shard = datafile_shard(&client_addr);
+        linebuf_init(&conn->rx);
+
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = conn,
+        };
+        if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, new_fd, &ev) < 0) {
+            syslog(LOG_ERR, "epoll_ctl add failed: %s", strerror(errno));
+            close(new_fd);
+            free(conn);
+            continue;
+        }
+        LIST_INSERT_HEAD(&reactor->conns, conn, entries);
+        syslog(LOG_INFO, "Accepted connection from %s", inet_ntoa(client_addr.sin_addr));
+    }
+}
+
+/**
+ * @brief Reactor thread: wait for readiness and dispatch until shutdown.
+ * Connections still open at shutdown are closed.
+ */
+static void *reactor_thread_func(void *arg) {
+    struct reactor *reactor = (struct reactor *)arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    reactor->epfd = epfd;
+    LIST_INIT(&reactor->conns);
+    if (epfd < 0) {
+        syslog(LOG_ERR, "epoll_create1 failed: %s", strerror(errno));
+        return NULL;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = &s_listen_token };
+    struct epoll_event wake_ev = { .events = EPOLLIN, .data.ptr = &s_wakeup_token };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, reactor->listen_fd, &ev) < 0 ||
+        epoll_ctl(epfd, EPOLL_CTL_ADD, g_wakeup_fd, &wake_ev) < 0) {
+        syslog(LOG_ERR, "epoll_ctl failed: %s", strerror(errno));
+        close(epfd);
+        return NULL;
+    }
+
+    while (!g_exit_flag) {
+        int nfds = epoll_wait(epfd, events, REACTOR_MAX_EVENTS, -1);
+        if (nfds < 0) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < nfds; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &s_wakeup_token)
+                continue;
+            if (ptr == &s_listen_token) {
+                reactor_accept(reactor);
+                continue;
+            }
+
+            struct epoll_conn *conn = ptr;
+            if ((events[i].events & EPOLLERR) || conn_process(conn) < 0)
+                conn_close(conn);
+        }
+    }
+
+    while (!LIST_EMPTY(&reactor->conns))
+        conn_close(LIST_FIRST(&reactor->conns));
+    close(epfd);
+    return NULL;
+}
+
+/**
+ * @brief Run @param reactors epoll reactor threads on @param listen_fd until
+ * g_exit_flag is set.
+ * @return 0 on clean shutdown, -1 if no reactor could be started
+ */
+int reactor_run(int listen_fd, unsigned int reactors) {
+    if (reactors == 0)
+        reactors = 1;
+
+    struct reactor *pool = calloc(reactors, sizeof(*pool));
+    if (!pool)
+        return -1;
+
+    unsigned int started = 0;
+    for (unsigned int i = 0; i < reactors; i++) {
+        pool[i].listen_fd = listen_fd;
+        if (pthread_create(&pool[i].thread_id, NULL, reactor_thread_func, &pool[i]) != 0) {
+            syslog(LOG_ERR, "Failed to start reactor %u", i);
+            break;
+        }
+        started++;
+    }
+
+    for (unsigned int i = 0; i < started; i++)
+        pthread_join(pool[i].thread_id, NULL);
+
+    free(pool);
+    return started ? 0 : -1;
+}
@@ -0,0 +1,153 @@
+/****************************************************************************
+ * @file threadpool.c
+ * @brief Fixed-size worker pool for aesdsocket client handling (-m pool)
+ * @author Parth Varsani
+ *
+ * - Workers are created once at startup, so accepting a connection only
+ *   queues a job instead of creating a thread
+ * - Jobs are handed over through a fixed ring of POOL_QUEUE_LEN entries
+ *   under a mutex + condition variable, so queueing never allocates and a
+ *   burst beyond the ring is refused instead of growing without bound
+ * - threadpool_drain() shuts down in-flight connections, closes queued
+ *   ones and joins every worker
+ ****************************************************************************/
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "aesdsocket.h"
+#include "../aesd-char-driver/aesd-ring.h"
+
+/* Accepted connections waiting for a worker, at most 1 << POOL_QUEUE_ORDER */
+#define POOL_QUEUE_ORDER 10
+
+struct pool_job {
+    int client_fd;
+    struct sockaddr_in client_addr;
+};
+
+AESD_RING_DEFINE(pool_job_ring, struct pool_job, POOL_QUEUE_ORDER)
+
+struct pool_worker {
+    pthread_t thread_id;
+    int active_fd;              /* connection being served, -1 when idle */
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct pool_job_ring jobs;          /* accepted, waiting for a worker */
+    struct pool_worker *workers;
+    unsigned int nworkers;
+    bool stopping;
+} g_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void *pool_worker_func(void *arg) {
+    struct pool_worker *worker = (struct pool_worker *)arg;
+
+    pthread_mutex_lock(&g_pool.lock);
+    for (;;) {
+        struct pool_job job;
+
+        while (!g_pool.stopping && pool_job_ring_empty(&g_pool.jobs))
+            pthread_cond_wait(&g_pool.cond, &g_pool.lock);
+        if (g_pool.stopping)
+            break;
+
+        pool_job_ring_pop(&g_pool.jobs, &job);
+        worker->active_fd = job.client_fd;
+        pthread_mutex_unlock(&g_pool.lock);
+
+        client_serve(job.client_fd, &job.client_addr);
+
+        /* Clear active_fd before closing so drain never shuts down a reused fd */
+        pthread_mutex_lock(&g_pool.lock);
+        worker->active_fd = -1;
+        close(job.client_fd);
+    }
+    pthread_mutex_unlock(&g_pool.lock);
+    return NULL;
+}
+
+/**
+ * @brief Start @param workers worker threads.
+ * @return 0 on success, -1 if no worker could be created
+ */
+int threadpool_start(unsigned int workers) {
+    pool_job_ring_init(&g_pool.jobs);
+    g_pool.stopping = false;
+
+    g_pool.workers = calloc(workers, sizeof(*g_pool.workers));
+    if (!g_pool.workers)
+        return -1;
+
+    g_pool.nworkers = 0;
+    for (unsigned int i = 0; i < workers; i++) {
+        g_pool.workers[i].active_fd = -1;
+        if (pthread_create(&g_pool.workers[i].thread_id, NULL, pool_worker_func,
+                           &g_pool.workers[i]) != 0) {
+            syslog(LOG_ERR, "Failed to start pool worker %u", i);
+            break;
+        }
+        g_pool.nworkers++;
+    }
+    syslog(LOG_INFO, "Started %u pool workers", g_pool.nworkers);
+    return g_pool.nworkers ? 0 : -1;
+}
+
+/**
+ * @brief Queue an accepted connection for the next idle worker.
+ * @return 0 on success, -1 if the pool is stopping or its queue is full
+ */
+int threadpool_submit(int client_fd, const struct sockaddr_in *client_addr) {
+    struct pool_job job = {
+        .client_fd = client_fd,
+        .client_addr = *client_addr,
+    };
+    int rc = -1;
+
+    pthread_mutex_lock(&g_pool.lock);
+    if (!g_pool.stopping) {
+        if (pool_job_ring_push(&g_pool.jobs, &job)) {
+            pthread_cond_signal(&g_pool.cond);
+            rc = 0;
+        } else {
+            syslog(LOG_WARNING, "Pool queue full, refusing connection");
+        }
+    }
+    pthread_mutex_unlock(&g_pool.lock);
+    return rc;
+}
+
+/**
+ * @brief Stop the pool: end in-flight sessions, drop queued connections and
+ * join all workers.
+ */
+void threadpool_drain(void) {
+    struct pool_job job;
+
+    pthread_mutex_lock(&g_pool.lock);
+    g_pool.stopping = true;
+    for (unsigned int i = 0; i < g_pool.nworkers; i++) {
+        if (g_pool.workers[i].active_fd >= 0)
+            shutdown(g_pool.workers[i].active_fd, SHUT_RDWR);
+    }
+    pthread_cond_broadcast(&g_pool.cond);
+    pthread_mutex_unlock(&g_pool.lock);
+
+    for (unsigned int i = 0; i < g_pool.nworkers; i++)
+        pthread_join(g_pool.workers[i].thread_id, NULL);
+
+    while (pool_job_ring_pop(&g_pool.jobs, &job))
+        close(job.client_fd);
+    free(g_pool.workers);
+    g_pool.workers = NULL;
+    g_pool.nworkers = 0;
+}
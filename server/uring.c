@@ -0,0 +1,877 @@
+/****************************************************************************
+ * @file uring.c
+ * @brief io_uring engine for aesdsocket (-m uring)
+ * @author Parth Varsani
+ *
+ * - Talks to the kernel through the raw io_uring_setup/enter/register
+ *   syscalls, so no liburing dependency is needed
+ * - Every data file shard is opened once and registered as fixed files (one
+ *   append fd, one read fd per shard); each connection slot owns a registered
+ *   write and tx buffer, so appends and echo reads use WRITE_FIXED/READ_FIXED
+ * - Received bytes are framed into lines in a per-connection struct linebuf
+ *   as in the epoll reactor; each batch of complete lines is copied into the
+ *   write buffer and appended with one WRITE_FIXED, batches larger than the
+ *   buffer are written straight from the line buffer
+ * - Appends write at offsets reserved with datafile_reserve(), so they never
+ *   overlap the timer thread's appends through datafile_append(); -y batch
+ *   and -y dsync make each append wait for storage through RWF_DSYNC and
+ *   O_DSYNC
+ * - recv, the append and the echo read/send of every connection are queued
+ *   as SQEs and submitted together with one io_uring_enter() per loop
+ *   iteration
+ * - A completed append is committed through datafile_complete() once every
+ *   append reserved before it has completed too; only then is it mirrored
+ *   into the in-memory append log and echoed, and echo reads stop at the
+ *   committed end the file had when the echo started.  Clients in
+ *   incremental echo mode are sent straight from log segment memory
+ * - uring_run() returns -1 before serving anyone when io_uring is not
+ *   available so the caller can fall back to the thread mode
+ * - On shutdown every SQE still in flight is cancelled and its completion
+ *   reaped before the connection and registered buffers are freed
+ ****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+#include "aesdsocket.h"
+
+#define URING_DEFAULT_CONNS 256
+
+/* Registered file table indexes, two per data file shard */
+#define URING_FILE_APPEND(shard) (2 * (shard))
+#define URING_FILE_READ(shard)   (2 * (shard) + 1)
+
+/* user_data layout: connection slot in the high bits, operation in the low byte */
+enum uring_op {
+    URING_OP_ACCEPT,
+    URING_OP_WAKEUP,
+    URING_OP_RECV,
+    URING_OP_WRITE,
+    URING_OP_READ,
+    URING_OP_SEND,
+    URING_OP_CANCEL,
+};
+
+#define URING_USER_DATA(slot, op) (((uint64_t)(slot) << 8) | (op))
+#define URING_SLOT(user_data)     ((unsigned int)((user_data) >> 8))
+#define URING_OP(user_data)       ((enum uring_op)((user_data) & 0xff))
+
+struct uring {
+    int fd;
+    unsigned int sq_entries;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int sqe_tail;          /* local tail, published on submit */
+    unsigned int to_submit;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_sz;
+    void *cq_ring;
+    size_t cq_ring_sz;
+    size_t sqes_sz;
+};
+
+struct uring_conn {
+    int fd;                         /* -1 when the slot is free */
+    struct sockaddr_in addr;
+    unsigned int shard;             /* data file shard picked from addr */
+    unsigned int inflight;          /* SQEs not yet completed */
+    bool closing;
+    bool eof;                       /* peer closed, flush the partial line */
+    struct linebuf rx;              /* received bytes not yet framed into lines */
+    size_t batch_len;               /* bytes of the data batch being appended */
+    size_t batch_written;           /* bytes of batch_len appended so far */
+    bool batch_fixed;               /* batch copied to the write buffer for WRITE_FIXED */
+    struct datafile_reservation res;    /* where the batch goes in the data file */
+    bool reserved;                  /* res not committed yet */
+    bool echo_pending;              /* the batch ended a line: echo after the append */
+    int echo_fd;                    /* AESDCHAR_IOCSEEKTO fd, else -1 (use fixed file) */
+    off_t echo_off;                 /* next data file offset to echo */
+    off_t echo_end;                 /* committed end when the echo started, or -1 */
+    size_t tx_len;
+    size_t tx_sent;
+    bool incremental;               /* AESDSOCKET_ECHO:incremental requested */
+    bool tx_from_log;               /* in-flight send reads from the append log */
+    struct applog_cursor cursor;
+};
+
+static struct {
+    struct uring ring;
+    struct uring_conn *conns;
+    unsigned int max_conns;
+    unsigned int nconns;
+    char *buffers;                  /* write buffers, then tx buffers */
+    int listen_fd;
+    bool accept_armed;
+} g_uring;
+
+static void conn_next_batch(unsigned int slot);
+
+static char *conn_write_buf(unsigned int slot) {
+    return g_uring.buffers + (size_t)slot * BUF_MAXLEN;
+}
+
+static char *conn_tx_buf(unsigned int slot) {
+    return g_uring.buffers + ((size_t)g_uring.max_conns + slot) * BUF_MAXLEN;
+}
+
+static int uring_setup(struct uring *ring, unsigned int entries) {
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return -1;
+
+    ring->sq_ring_sz = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_sz = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_sz > ring->sq_ring_sz)
+            ring->sq_ring_sz = ring->cq_ring_sz;
+        ring->cq_ring_sz = ring->sq_ring_sz;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto err_close;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+            goto err_unmap_sq;
+    }
+
+    ring->sqes_sz = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto err_unmap_cq;
+
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_entries = params.sq_entries;
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->sqe_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+
+err_unmap_cq:
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_sz);
+err_unmap_sq:
+    munmap(ring->sq_ring, ring->sq_ring_sz);
+err_close:
+    close(ring->fd);
+    ring->fd = -1;
+    return -1;
+}
+
+static void uring_teardown(struct uring *ring) {
+    munmap(ring->sqes, ring->sqes_sz);
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_sz);
+    munmap(ring->sq_ring, ring->sq_ring_sz);
+    close(ring->fd);
+}
+
+/**
+ * @brief Publish queued SQEs and optionally wait for @param wait_nr completions.
+ */
+static int uring_submit(struct uring *ring, unsigned int wait_nr) {
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    for (;;) {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait_nr,
+                          wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0) {
+            ring->to_submit -= ret;
+            return ret;
+        }
+        if (errno != EINTR || g_exit_flag)
+            return -1;
+    }
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+        /* Submission queue full: hand what we have to the kernel first */
+        if (uring_submit(ring, 0) < 0)
+            return NULL;
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sqe_tail - head >= ring->sq_entries)
+            return NULL;
+    }
+
+    unsigned int index = ring->sqe_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    ring->sq_array[index] = index;
+    ring->sqe_tail++;
+    ring->to_submit++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static struct io_uring_sqe *conn_get_sqe(unsigned int slot, enum uring_op op) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&g_uring.ring);
+    if (sqe) {
+        sqe->user_data = URING_USER_DATA(slot, op);
+        g_uring.conns[slot].inflight++;
+    }
+    return sqe;
+}
+
+static void arm_accept(void) {
+    if (g_uring.accept_armed || g_uring.nconns == g_uring.max_conns || g_exit_flag)
+        return;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&g_uring.ring);
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = g_uring.listen_fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = URING_USER_DATA(0, URING_OP_ACCEPT);
+    g_uring.accept_armed = true;
+}
+
+static void arm_wakeup(void) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&g_uring.ring);
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = g_wakeup_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_USER_DATA(0, URING_OP_WAKEUP);
+}
+
+static void conn_recv(unsigned int slot) {
+    struct uring_conn *conn = &g_uring.conns[slot];
+    size_t avail;
+    char *space = linebuf_space(&conn->rx, &avail);
+    struct io_uring_sqe *sqe = space ? conn_get_sqe(slot, URING_OP_RECV) : NULL;
+    if (!sqe) {
+        conn->closing = true;
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)space;
+    sqe->len = avail;
+}
+
+static void conn_echo_done(unsigned int slot) {
+    struct uring_conn *conn = &g_uring.conns[slot];
+
+    conn->echo_pending = false;
+    if (conn->echo_fd >= 0) {
+        close(conn->echo_fd);
+        conn->echo_fd = -1;
+    }
+    conn_next_batch(slot);
+}
+
+/**
+ * @brief Queue the next echo read: the fixed read fd at echo_off, or the
+ * AESDCHAR_IOCSEEKTO fd at its current position.  The echo ends at
+ * echo_end, so it finishes while appends continue and, in the /var/tmp
+ * build, never reaches reserved bytes that may not have been written yet.
+ */
+static void conn_read(unsigned int slot) {
+    struct uring_conn *conn = &g_uring.conns[slot];
+    size_t len = BUF_MAXLEN;
+
+    if (conn->echo_end >= 0) {
+        if (conn->echo_off >= conn->echo_end) {
+            conn_echo_done(slot);
+            return;
+        }
+        if ((off_t)len > conn->echo_end - conn->echo_off)
+            len = conn->echo_end - conn->echo_off;
+    }
+
+    struct io_uring_sqe *sqe = conn_get_sqe(slot, URING_OP_READ);
+    if (!sqe) {
+        conn->closing = true;
+        return;
+    }
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->addr = (uintptr_t)conn_tx_buf(slot);
+    sqe->len = len;
+    sqe->buf_index = g_uring.max_conns + slot;
+    if (conn->echo_fd >= 0) {
+        sqe->fd = conn->echo_fd;
+        sqe->off = (uint64_t)-1;
+    } else {
+        sqe->fd = URING_FILE_READ(conn->shard);
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->off = conn->echo_off;
+    }
+}
+
+/**
+ * @brief Start echoing the data file of @param slot, from the position of
+ * the AESDCHAR_IOCSEEKTO descriptor @param seek_fd or, if it is -1, from the
+ * start, up to the end the file has now.
+ */
+static void conn_echo_start(unsigned int slot, int seek_fd) {
+    struct uring_conn *conn = &g_uring.conns[slot];
+
+    conn->echo_fd = seek_fd;
+    conn->echo_off = seek_fd >= 0 ? lseek(seek_fd, 0, SEEK_CUR) : 0;
+    if (conn->echo_off >= 0) {
+        conn->echo_end = datafile_committed(conn->shard);
+    } else {
+        conn->echo_off = 0;
+        conn->echo_end = -1;    /* no position to bound from, read to end of file */
+    }
+    conn_read(slot);
+}
+
+/**
+ * @brief Queue the append of the unwritten part of the current batch at its
+ * reserved offset.  Batches that fit were copied to the registered write
+ * buffer, larger ones are written straight from the line buffer.
+ */
+static void conn_write(unsigned int slot) {
+    struct uring_conn *conn = &g_uring.conns[slot];
+    struct io_uring_sqe *sqe = conn_get_sqe(slot, URING_OP_WRITE);
+    if (!sqe) {
+        conn->closing = true;
+        return;
+    }
+    if (conn->batch_fixed) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->addr = (uintptr_t)(conn_write_buf(slot) + conn->batch_written);
+        sqe->buf_index = slot;
+    } else {
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->addr = (uintptr_t)(conn->rx.data + conn->batch_written);
+    }
+    sqe->fd = URING_FILE_APPEND(conn->shard);
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->off = conn->res.offset + conn->batch_written;
+    sqe->len = conn->batch_len - conn->batch_written;
+    /* With -y batch each append is its own batch */
+    if (datafile_durability() == DURABILITY_BATCH)
+        sqe->rw_flags = RWF_DSYNC;
+}
+
+static void conn_send(unsigned int slot) {
+    struct uring_conn *conn = &g_uring.conns[slot];
+    struct io_uring_sqe *sqe = conn_get_sqe(slot, URING_OP_SEND);
+    if (!sqe) {
+        conn->closing = true;
+        return;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)(conn_tx_buf(slot) + conn->tx_sent);
+    sqe->len = conn->tx_len - conn->tx_sent;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    conn->tx_from_log = false;
+}
+
+/**
+ * @brief Handle the next framed batch in the receive buffer like the epoll
+ * reactor does: apply command lines one at a time, or start the append of a
+ * data batch.  Goes back to receiving once no complete batch is buffered,
+ * and closes the connection once the peer's last bytes are handled.
+ */
+static void conn_next_batch(unsigned int slot) {
+    struct uring_conn *conn = &g_uring.conns[slot];
+    struct linebuf_batch batch;
+
+    for (;;) {
+        enum linebuf_batch_kind kind = linebuf_next_batch(&conn->rx, &batch, conn->eof);
+
+        if (kind == LINEBUF_BATCH_NONE) {
+            if (conn->eof)
+                conn->closing = true;
+            else
+                conn_recv(slot);
+            return;
+        }
+
+        if (kind == LINEBUF_BATCH_DATA) {
+            conn->batch_len = batch.len;
+            conn->batch_written = 0;
+            conn->echo_pending = batch.terminated;
+            /* Batch lines are consecutive from the start of the buffer */
+            conn->batch_fixed = batch.len <= BUF_MAXLEN;
+            if (conn->batch_fixed)
+                memcpy(conn_write_buf(slot), conn->rx.data, batch.len);
+            datafile_reserve(conn->shard, &conn->res, conn->rx.data, batch.len);
+            conn->reserved = true;
+            conn_write(slot);
+            return;
+        }
+
+        const char *line = batch.iov[0].iov_base;
+        size_t line_len = batch.iov[0].iov_len;
+        int echo_mode = applog_echo_command(line, line_len);
+        int seek_fd = -1;
+
+        if (echo_mode >= 0) {
+            if (echo_mode && !conn->incremental)
+                applog_cursor_init(&conn->cursor, conn->shard);
+            else if (!echo_mode && conn->incremental)
+                applog_cursor_release(&conn->cursor);
+            conn->incremental = echo_mode;
+        } else {
+            /* The ioctl has no io_uring opcode; the echo itself still goes through the ring */
+            seek_fd = datafile_open_seekto(conn->shard, line, line_len);
+        }
+        linebuf_consume(&conn->rx, batch.len);
+        if (seek_fd >= 0) {
+            conn_echo_start(slot, seek_fd);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Queue a send of the next unsent append log bytes, or go on with
+ * the receive buffer once the incremental echo is complete.  The cursor keeps the
+ * segment referenced while the kernel reads from it.
+ */
+static void conn_send_log(unsigned int slot) {
+    struct uring_conn *conn = &g_uring.conns[slot];
+    size_t len;
+    const char *data = applog_cursor_peek(&conn->cursor, &len);
+
+    if (!data) {
+        conn->echo_pending = false;
+        conn_next_batch(slot);
+        return;
+    }
+
+    struct io_uring_sqe *sqe = conn_get_sqe(slot, URING_OP_SEND);
+    if (!sqe) {
+        conn->closing = true;
+        return;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)data;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    conn->tx_from_log = true;
+}
+
+static void conn_release(unsigned int slot) {
+    struct uring_conn *conn = &g_uring.conns[slot];
+
+    syslog(LOG_INFO, "Closed connection from %s", inet_ntoa(conn->addr.sin_addr));
+    /* Only at shutdown: abandon the append so the shard's queue drains */
+    if (conn->reserved)
+        datafile_complete(conn->shard, &conn->res, false);
+    if (conn->echo_fd >= 0)
+        close(conn->echo_fd);
+    if (conn->incremental)
+        applog_cursor_release(&conn->cursor);
+    linebuf_free(&conn->rx);
+    close(conn->fd);
+    conn->fd = -1;
+    g_uring.nconns--;
+}
+
+static void handle_accept(int res) {
+    g_uring.accept_armed = false;
+    if (res < 0) {
+        if (!g_exit_flag)
+            syslog(LOG_ERR, "accept failed: %s", strerror(-res));
+        return;
+    }
+    /* Completed while shutting down, before it could be cancelled */
+    if (g_exit_flag) {
+        close(res);
+        return;
+    }
+
+    unsigned int slot;
+    for (slot = 0; slot < g_uring.max_conns; slot++) {
+        if (g_uring.conns[slot].fd < 0)
+            break;
+    }
+
+    struct uring_conn *conn = &g_uring.conns[slot];
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = res;
+    conn->echo_fd = -1;
+    linebuf_init(&conn->rx);
+    socklen_t addr_len = sizeof(conn->addr);
+    getpeername(res, (struct sockaddr *)&conn->addr, &addr_len);
+    conn->shard = datafile_shard(&conn->addr);
+    g_uring.nconns++;
+    syslog(LOG_INFO, "Accepted connection from %s", inet_ntoa(conn->addr.sin_addr));
+    conn_recv(slot);
+}
+
+static void handle_recv(unsigned int slot, int res) {
+    struct uring_conn *conn = &g_uring.conns[slot];
+
+    if (res < 0) {
+        conn->closing = true;
+        return;
+    }
+
+    if (res == 0)
+        conn->eof = true;
+    else
+        linebuf_commit(&conn->rx, res);
+    conn_next_batch(slot);
+}
+
+static void conn_release_idle(unsigned int slot) {
+    struct uring_conn *conn = &g_uring.conns[slot];
+
+    if (conn->fd >= 0 && conn->closing && conn->inflight == 0 && !conn->reserved)
+        conn_release(slot);
+}
+
+/**
+ * @brief Go on with every connection whose append is in the committed list
+ * @param res from datafile_complete(): echo the batch, now readable and in
+ * the append log, or release the connection if it is closing.
+ */
+static void conn_committed(struct datafile_reservation *res) {
+    while (res) {
+        struct datafile_reservation *next = res->next;
+        struct uring_conn *conn = (struct uring_conn *)((char *)res -
+                                                        offsetof(struct uring_conn, res));
+        unsigned int slot = conn - g_uring.conns;
+
+        conn->reserved = false;
+        if (conn->closing) {
+            conn_release_idle(slot);
+        } else {
+            linebuf_consume(&conn->rx, conn->batch_len);
+            if (!conn->echo_pending) {
+                conn_next_batch(slot);
+            } else {
+                if (conn->incremental && applog_cursor_mark(&conn->cursor) != 0)
+                    conn->incremental = false;
+                if (conn->incremental)
+                    conn_send_log(slot);
+                else
+                    conn_echo_start(slot, -1);
+            }
+        }
+        res = next;
+    }
+}
+
+static void handle_write(unsigned int slot, int res) {
+    struct uring_conn *conn = &g_uring.conns[slot];
+
+    if (res <= 0) {
+        /* A write that stores nothing would only be retried forever */
+        syslog(LOG_ERR, "Failed to write %s: %s", datafile_path(conn->shard),
+               res ? strerror(-res) : "no bytes written");
+        conn->closing = true;
+    } else {
+        conn->batch_written += res;
+        if (conn->batch_written < conn->batch_len && !conn->closing) {
+            conn_write(slot);
+            if (!conn->closing)
+                return;
+        }
+    }
+
+    /* Completed even when abandoned, later appends to the shard wait for it */
+    conn_committed(datafile_complete(conn->shard, &conn->res,
+                                     conn->batch_written == conn->batch_len));
+}
+
+static void handle_read(unsigned int slot, int res) {
+    struct uring_conn *conn = &g_uring.conns[slot];
+
+    if (res < 0) {
+        syslog(LOG_ERR, "Failed to read %s: %s", datafile_path(conn->shard), strerror(-res));
+        conn->closing = true;
+        return;
+    }
+
+    if (res == 0) {
+        conn_echo_done(slot);
+        return;
+    }
+
+    conn->echo_off += res;
+    conn->tx_len = res;
+    conn->tx_sent = 0;
+    conn_send(slot);
+}
+
+static void handle_send(unsigned int slot, int res) {
+    struct uring_conn *conn = &g_uring.conns[slot];
+
+    if (res < 0) {
+        conn->closing = true;
+        return;
+    }
+
+    if (conn->tx_from_log) {
+        applog_cursor_advance(&conn->cursor, res);
+        conn_send_log(slot);
+        return;
+    }
+
+    conn->tx_sent += res;
+    if (conn->tx_sent < conn->tx_len)
+        conn_send(slot);
+    else
+        conn_read(slot);
+}
+
+/**
+ * @brief Queue the cancellation of the SQE tagged @param user_data, or of
+ * every SQE in flight with IORING_ASYNC_CANCEL_ANY in @param flags.
+ */
+static void uring_cancel(uint64_t user_data, unsigned int flags) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&g_uring.ring);
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->cancel_flags = flags;
+    sqe->user_data = URING_USER_DATA(0, URING_OP_CANCEL);
+}
+
+/**
+ * @brief Handle the completion of a cancellation.  Kernels before 5.19
+ * reject IORING_ASYNC_CANCEL_ANY, so cancel each connection operation that
+ * may be in flight instead; those that are not complete with -ENOENT.
+ */
+static void handle_cancel(int res) {
+    if (res != -EINVAL)
+        return;
+    uring_cancel(URING_USER_DATA(0, URING_OP_ACCEPT), 0);
+    uring_cancel(URING_USER_DATA(0, URING_OP_WAKEUP), 0);
+    for (unsigned int slot = 0; slot < g_uring.max_conns; slot++) {
+        if (g_uring.conns[slot].fd < 0 || g_uring.conns[slot].inflight == 0)
+            continue;
+        for (enum uring_op op = URING_OP_RECV; op <= URING_OP_SEND; op++)
+            uring_cancel(URING_USER_DATA(slot, op), 0);
+    }
+}
+
+static void handle_cqe(const struct io_uring_cqe *cqe) {
+    unsigned int slot = URING_SLOT(cqe->user_data);
+
+    switch (URING_OP(cqe->user_data)) {
+    case URING_OP_ACCEPT:
+        handle_accept(cqe->res);
+        return;
+    case URING_OP_WAKEUP:
+        return;
+    case URING_OP_CANCEL:
+        handle_cancel(cqe->res);
+        return;
+    case URING_OP_RECV:
+        g_uring.conns[slot].inflight--;
+        if (!g_uring.conns[slot].closing)
+            handle_recv(slot, cqe->res);
+        break;
+    case URING_OP_WRITE:
+        /* Even for a closing connection, its reservation must complete */
+        g_uring.conns[slot].inflight--;
+        handle_write(slot, cqe->res);
+        break;
+    case URING_OP_READ:
+        g_uring.conns[slot].inflight--;
+        if (!g_uring.conns[slot].closing)
+            handle_read(slot, cqe->res);
+        break;
+    case URING_OP_SEND:
+        g_uring.conns[slot].inflight--;
+        if (!g_uring.conns[slot].closing)
+            handle_send(slot, cqe->res);
+        break;
+    }
+
+    conn_release_idle(slot);
+}
+
+static void uring_reap(void) {
+    unsigned int head = *g_uring.ring.cq_head;
+    unsigned int tail = __atomic_load_n(g_uring.ring.cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++)
+        handle_cqe(&g_uring.ring.cqes[head & *g_uring.ring.cq_mask]);
+    __atomic_store_n(g_uring.ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Cancel everything still in flight and reap completions until no
+ * connection has an SQE left.  Closing the ring does not wait for requests
+ * io-wq is already running, which could still read or fill the registered
+ * and line buffers after they were freed.
+ * @return 0 once nothing is in flight, -1 if the ring failed first (logged)
+ */
+static int uring_drain(void) {
+    for (unsigned int slot = 0; slot < g_uring.max_conns; slot++)
+        g_uring.conns[slot].closing = true;
+    uring_cancel(0, IORING_ASYNC_CANCEL_ANY);
+
+    for (;;) {
+        unsigned int inflight = 0;
+        for (unsigned int slot = 0; slot < g_uring.max_conns; slot++) {
+            if (g_uring.conns[slot].fd >= 0)
+                inflight += g_uring.conns[slot].inflight;
+        }
+        if (inflight == 0)
+            return 0;
+
+        /* g_exit_flag is set, so uring_submit() gives up on EINTR: retry here */
+        if (uring_submit(&g_uring.ring, 1) < 0 && errno != EINTR) {
+            syslog(LOG_ERR, "io_uring_enter failed draining %u requests: %s", inflight,
+                   strerror(errno));
+            return -1;
+        }
+        uring_reap();
+    }
+}
+
+static int uring_register(void) {
+    struct uring *ring = &g_uring.ring;
+    unsigned int nbufs = 2 * g_uring.max_conns;
+
+    if (posix_memalign((void **)&g_uring.buffers, 4096, (size_t)nbufs * BUF_MAXLEN) != 0)
+        return -1;
+
+    struct iovec *iov = calloc(nbufs, sizeof(*iov));
+    if (!iov)
+        return -1;
+    for (unsigned int i = 0; i < nbufs; i++) {
+        iov[i].iov_base = g_uring.buffers + (size_t)i * BUF_MAXLEN;
+        iov[i].iov_len = BUF_MAXLEN;
+    }
+    int ret = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, nbufs);
+    free(iov);
+    if (ret < 0) {
+        syslog(LOG_ERR, "io_uring buffer registration failed: %s", strerror(errno));
+        return -1;
+    }
+
+    unsigned int nfiles = 2 * datafile_shards();
+    int files[2 * DATAFILE_MAX_SHARDS];
+
+    for (unsigned int shard = 0; shard < datafile_shards(); shard++) {
+        const char *path = datafile_path(shard);
+#ifdef USE_AESD_CHAR_DEVICE
+        files[URING_FILE_APPEND(shard)] = open(path, O_WRONLY);
+        files[URING_FILE_READ(shard)] = open(path, O_RDONLY);
+#else
+        files[URING_FILE_APPEND(shard)] = open(path, O_WRONLY | O_CREAT |
+            (datafile_durability() == DURABILITY_DSYNC ? O_DSYNC : 0), 0644);
+        files[URING_FILE_READ(shard)] = open(path, O_RDONLY | O_CREAT, 0644);
+#endif
+        if (files[URING_FILE_APPEND(shard)] < 0 || files[URING_FILE_READ(shard)] < 0) {
+            syslog(LOG_ERR, "Failed to open %s: %s", path, strerror(errno));
+            ret = -1;
+        }
+    }
+    if (ret >= 0) {
+        ret = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, files, nfiles);
+        if (ret < 0)
+            syslog(LOG_ERR, "io_uring file registration failed: %s", strerror(errno));
+    }
+    /* The ring holds its own references to registered files */
+    for (unsigned int i = 0; i < nfiles; i++) {
+        if (files[i] >= 0)
+            close(files[i]);
+    }
+    return ret < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Serve clients from a single io_uring until g_exit_flag is set.
+ * @param max_conns the maximum number of concurrent connections (0 for default)
+ * @return 0 on clean shutdown, -1 if io_uring is unavailable
+ */
+int uring_run(int listen_fd, unsigned int max_conns) {
+    if (max_conns == 0)
+        max_conns = URING_DEFAULT_CONNS;
+
+    memset(&g_uring, 0, sizeof(g_uring));
+    g_uring.max_conns = max_conns;
+    g_uring.listen_fd = listen_fd;
+
+    /* One SQE per connection, plus the accept and the wakeup poll */
+    unsigned int entries = 1;
+    while (entries < max_conns + 2)
+        entries <<= 1;
+    if (uring_setup(&g_uring.ring, entries) != 0) {
+        syslog(LOG_WARNING, "io_uring unavailable: %s", strerror(errno));
+        return -1;
+    }
+
+    g_uring.conns = calloc(max_conns, sizeof(*g_uring.conns));
+    if (!g_uring.conns || uring_register() != 0) {
+        free(g_uring.conns);
+        free(g_uring.buffers);
+        uring_teardown(&g_uring.ring);
+        return -1;
+    }
+    for (unsigned int i = 0; i < max_conns; i++)
+        g_uring.conns[i].fd = -1;
+
+    arm_wakeup();
+    while (!g_exit_flag) {
+        arm_accept();
+        if (uring_submit(&g_uring.ring, 1) < 0) {
+            if (!g_exit_flag)
+                syslog(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+            break;
+        }
+        uring_reap();
+    }
+
+    if (uring_drain() != 0) {
+        /* Leak the buffers rather than free them under requests still in flight */
+        uring_teardown(&g_uring.ring);
+        return 0;
+    }
+    uring_teardown(&g_uring.ring);
+    for (unsigned int i = 0; i < max_conns; i++) {
+        if (g_uring.conns[i].fd >= 0)
+            conn_release(i);
+    }
+    free(g_uring.conns);
+    free(g_uring.buffers);
+    return 0;
+}
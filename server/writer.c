@@ -0,0 +1,226 @@
+/****************************************************************************
+ * @file writer.c
+ * @brief Single writer thread with group commit for aesdsocket (-g)
+ * @author Parth Varsani
+ *
+ * - datafile_appendv() callers hand their lines to one writer thread through
+ *   a lock-free multi-producer ring and sleep until they are stored, so the
+ *   echo that follows still sees its own lines
+ * - The writer takes everything pending at once and commits it per shard
+ *   with one writev() and, with -y batch, one fdatasync(), so data file calls
+ *   grow with the number of batches instead of the number of packets
+ * - Callers are woken one by one through a semaphore in their request, the
+ *   writer through a condition variable only when it went idle
+ ****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include "aesdsocket.h"
+#include "../aesd-char-driver/aesd-ring-lockfree.h"
+
+/* Appends waiting for the writer, at most 1 << WRITER_QUEUE_ORDER */
+#define WRITER_QUEUE_ORDER 10
+
+/* Most appends taken from the queue per batch */
+#define WRITER_MAX_BATCH 256
+
+/* Most buffers per writev(), the Linux IOV_MAX */
+#define WRITER_MAX_IOV 1024
+
+/**
+ * One datafile_appendv() call waiting for the writer, on the caller's stack
+ */
+struct writer_req {
+    unsigned int shard;
+    const struct iovec *iov;
+    int iovcnt;
+    int rc;
+    sem_t done;
+};
+
+/* The ring macros need a single type name to qualify const */
+typedef struct writer_req *writer_req_ptr;
+
+AESD_MPSC_RING_DEFINE(writer_queue, writer_req_ptr, WRITER_QUEUE_ORDER)
+
+static struct {
+    struct writer_queue *queue;
+    pthread_t thread;
+    bool running;
+    pthread_mutex_t lock;       /* guards the idle wait and stopping */
+    pthread_cond_t wake;
+    atomic_bool idle;           /* writer waits on wake, producers must signal */
+    bool stopping;
+    unsigned long appends;      /* statistics, writer thread only */
+    unsigned long batches;
+    unsigned long writes;
+} g_writer = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * @brief Store @param n requests, grouping the requests of each shard in
+ * queue order into as few writev() calls as possible, then wake their callers.
+ */
+static void writer_commit(struct writer_req **reqs, unsigned int n) {
+    static struct iovec iov[WRITER_MAX_IOV];
+    bool taken[WRITER_MAX_BATCH] = { false };
+
+    for (unsigned int i = 0; i < n; i++) {
+        unsigned int group[WRITER_MAX_BATCH];
+        unsigned int ngroup = 0;
+        unsigned int shard = reqs[i]->shard;
+        int iovcnt = 0;
+
+        if (taken[i])
+            continue;
+        /* A prefix of the shard's remaining requests, so their order holds */
+        for (unsigned int j = i; j < n; j++) {
+            if (taken[j] || reqs[j]->shard != shard)
+                continue;
+            if (iovcnt + reqs[j]->iovcnt > WRITER_MAX_IOV)
+                break;
+            memcpy(&iov[iovcnt], reqs[j]->iov, reqs[j]->iovcnt * sizeof(iov[0]));
+            iovcnt += reqs[j]->iovcnt;
+            group[ngroup++] = j;
+            taken[j] = true;
+        }
+
+        int rc = datafile_writev(shard, iov, iovcnt);
+        if (rc == 0)
+            rc = datafile_sync_batch(shard);
+        g_writer.writes++;
+        for (unsigned int k = 0; k < ngroup; k++)
+            reqs[group[k]]->rc = rc;
+    }
+
+    for (unsigned int i = 0; i < n; i++)
+        sem_post(&reqs[i]->done);
+    g_writer.appends += n;
+    g_writer.batches++;
+}
+
+/**
+ * @brief Wait until an append is queued and return it, or NULL once the
+ * writer is stopping with nothing left.
+ */
+static struct writer_req *writer_wait(void) {
+    struct writer_req *req = NULL;
+
+    pthread_mutex_lock(&g_writer.lock);
+    atomic_store(&g_writer.idle, true);
+    /* Pairs with the fence in writer_append(): either the producer sees idle
+     * set, or this pop sees its request */
+    atomic_thread_fence(memory_order_seq_cst);
+    while (!writer_queue_pop(g_writer.queue, &req) && !g_writer.stopping)
+        pthread_cond_wait(&g_writer.wake, &g_writer.lock);
+    atomic_store(&g_writer.idle, false);
+    pthread_mutex_unlock(&g_writer.lock);
+    return req;
+}
+
+static void *writer_thread_func(void *arg) {
+    static struct writer_req *reqs[WRITER_MAX_BATCH];
+    (void)arg;
+
+    for (;;) {
+        unsigned int n = 1;
+
+        if (!writer_queue_pop(g_writer.queue, &reqs[0])) {
+            reqs[0] = writer_wait();
+            if (!reqs[0])
+                break;
+        }
+        /* Everything queued meanwhile joins the batch */
+        while (n < WRITER_MAX_BATCH && writer_queue_pop(g_writer.queue, &reqs[n]))
+            n++;
+        writer_commit(reqs, n);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start the writer thread, after which datafile_appendv() goes
+ * through it.
+ * @return 0 on success, -1 on failure (logged)
+ */
+int writer_start(void) {
+    g_writer.queue = aligned_alloc(AESD_RING_CACHE_LINE, sizeof(*g_writer.queue));
+    if (!g_writer.queue) {
+        syslog(LOG_ERR, "Out of memory for the writer queue");
+        return -1;
+    }
+    writer_queue_init(g_writer.queue);
+    atomic_init(&g_writer.idle, false);
+    g_writer.stopping = false;
+    if (pthread_create(&g_writer.thread, NULL, writer_thread_func, NULL) != 0) {
+        syslog(LOG_ERR, "Failed to start the writer thread");
+        free(g_writer.queue);
+        g_writer.queue = NULL;
+        return -1;
+    }
+    g_writer.running = true;
+    return 0;
+}
+
+/**
+ * @brief Commit what is queued and join the writer.  Every thread that may
+ * append must have finished.
+ */
+void writer_stop(void) {
+    if (!g_writer.running)
+        return;
+    pthread_mutex_lock(&g_writer.lock);
+    g_writer.stopping = true;
+    pthread_cond_signal(&g_writer.wake);
+    pthread_mutex_unlock(&g_writer.lock);
+    pthread_join(g_writer.thread, NULL);
+    g_writer.running = false;
+
+    syslog(LOG_INFO, "Group commit: %lu appends in %lu batches, %lu writes",
+           g_writer.appends, g_writer.batches, g_writer.writes);
+    free(g_writer.queue);
+    g_writer.queue = NULL;
+}
+
+bool writer_enabled(void) {
+    return g_writer.running;
+}
+
+/**
+ * @brief Queue @param iovcnt buffers for data file @param shard and wait
+ * until the writer has stored them.
+ * @return 0 on success, -1 on failure (logged by the writer)
+ */
+int writer_append(unsigned int shard, const struct iovec *iov, int iovcnt) {
+    struct writer_req req = {
+        .shard = shard,
+        .iov = iov,
+        .iovcnt = iovcnt,
+    };
+    struct writer_req *reqp = &req;
+
+    sem_init(&req.done, 0, 0);
+    while (!writer_queue_push(g_writer.queue, &reqp))
+        sched_yield();
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&g_writer.idle, memory_order_relaxed)) {
+        pthread_mutex_lock(&g_writer.lock);
+        pthread_cond_signal(&g_writer.wake);
+        pthread_mutex_unlock(&g_writer.lock);
+    }
+
+    while (sem_wait(&req.done) != 0)
+        ;   /* EINTR */
+    sem_destroy(&req.done);
+    return req.rc;
+}
@@ -0,0 +1,107 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../server/aesdsocket.h"
+
+/**
+* Framing tests for the aesdsocket receive buffer: bytes are fed in through linebuf_space() and
+* linebuf_commit() as recv() would, and linebuf_next_batch() must only hand out complete lines
+* unless the connection is flushing or a single partial line reached LINEBUF_MAX_LEN.
+*/
+
+static void linebuf_feed(struct linebuf *lb, const char *data, size_t len)
+{
+    while (len > 0) {
+        size_t avail;
+        char *space = linebuf_space(lb, &avail);
+
+        TEST_ASSERT_NOT_NULL(space);
+        TEST_ASSERT_TRUE_MESSAGE(avail > 0, "No room left in the receive buffer");
+        if (avail > len)
+            avail = len;
+        memcpy(space, data, avail);
+        linebuf_commit(lb, avail);
+        data += avail;
+        len -= avail;
+    }
+}
+
+void test_linebuf_frames_complete_lines()
+{
+    struct linebuf lb;
+    struct linebuf_batch batch;
+
+    linebuf_init(&lb);
+    linebuf_feed(&lb, "one\ntwo\nthr", 11);
+    TEST_ASSERT_EQUAL_INT(LINEBUF_BATCH_DATA, linebuf_next_batch(&lb, &batch, false));
+    TEST_ASSERT_EQUAL_INT(2, batch.iovcnt);
+    TEST_ASSERT_EQUAL(8, batch.len);
+    TEST_ASSERT_TRUE_MESSAGE(batch.terminated, "Complete lines must ask for an echo");
+    linebuf_consume(&lb, batch.len);
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(LINEBUF_BATCH_NONE, linebuf_next_batch(&lb, &batch, false),
+                                  "A partial line must wait for its newline");
+    linebuf_feed(&lb, "ee\n", 3);
+    TEST_ASSERT_EQUAL_INT(LINEBUF_BATCH_DATA, linebuf_next_batch(&lb, &batch, false));
+    TEST_ASSERT_EQUAL(6, batch.len);
+    TEST_ASSERT_TRUE(memcmp(batch.iov[0].iov_base, "three\n", 6) == 0);
+    linebuf_consume(&lb, batch.len);
+
+    linebuf_feed(&lb, "tail", 4);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(LINEBUF_BATCH_DATA, linebuf_next_batch(&lb, &batch, true),
+                                  "Flushing must hand out the partial line");
+    TEST_ASSERT_FALSE_MESSAGE(batch.terminated, "A flushed partial line must not ask for an echo");
+    linebuf_free(&lb);
+}
+
+void test_linebuf_commands_stand_alone()
+{
+    static const char input[] = "a\nAESDSOCKET_ECHO:incremental\nb\n";
+    struct linebuf lb;
+    struct linebuf_batch batch;
+
+    linebuf_init(&lb);
+    linebuf_feed(&lb, input, strlen(input));
+    TEST_ASSERT_EQUAL_INT(LINEBUF_BATCH_DATA, linebuf_next_batch(&lb, &batch, false));
+    TEST_ASSERT_EQUAL(2, batch.len);
+    linebuf_consume(&lb, batch.len);
+    TEST_ASSERT_EQUAL_INT(LINEBUF_BATCH_COMMAND, linebuf_next_batch(&lb, &batch, false));
+    TEST_ASSERT_EQUAL(strlen("AESDSOCKET_ECHO:incremental\n"), batch.len);
+    linebuf_consume(&lb, batch.len);
+    TEST_ASSERT_EQUAL_INT(LINEBUF_BATCH_DATA, linebuf_next_batch(&lb, &batch, false));
+    TEST_ASSERT_EQUAL(2, batch.len);
+    linebuf_free(&lb);
+}
+
+void test_linebuf_full_buffer_keeps_short_tail()
+{
+    struct linebuf lb;
+    struct linebuf_batch batch;
+    char *line = malloc(LINEBUF_MAX_LEN);
+
+    /* Complete lines filling the buffer to exactly LINEBUF_MAX_LEN, then a short partial line */
+    TEST_ASSERT_NOT_NULL(line);
+    memset(line, 'x', LINEBUF_MAX_LEN);
+    line[LINEBUF_MAX_LEN - 11] = '\n';
+    linebuf_init(&lb);
+    linebuf_feed(&lb, line, LINEBUF_MAX_LEN);
+
+    TEST_ASSERT_EQUAL_INT(LINEBUF_BATCH_DATA, linebuf_next_batch(&lb, &batch, false));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, batch.iovcnt, "Short partial line split off a full buffer");
+    TEST_ASSERT_EQUAL(LINEBUF_MAX_LEN - 10, batch.len);
+    TEST_ASSERT_TRUE(batch.terminated);
+    linebuf_consume(&lb, batch.len);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(LINEBUF_BATCH_NONE, linebuf_next_batch(&lb, &batch, false),
+                                  "Short partial line handed out unterminated");
+
+    /* A single partial line of LINEBUF_MAX_LEN is handed out so the buffer cannot grow further */
+    linebuf_consume(&lb, lb.len);
+    line[LINEBUF_MAX_LEN - 11] = 'x';
+    linebuf_feed(&lb, line, LINEBUF_MAX_LEN);
+    TEST_ASSERT_EQUAL_INT(LINEBUF_BATCH_DATA, linebuf_next_batch(&lb, &batch, false));
+    TEST_ASSERT_EQUAL(LINEBUF_MAX_LEN, batch.len);
+    TEST_ASSERT_FALSE(batch.terminated);
+    linebuf_free(&lb);
+    free(line);
+}
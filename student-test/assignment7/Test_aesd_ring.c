@@ -0,0 +1,143 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+#include "../../aesd-char-driver/aesd-ring.h"
+
+/**
+* Equivalence tests for the AESD_RING_DEFINE() rings against aesd_circular_buffer: the same
+* random sequence of adds and removals is applied to both, and after every step they must hold
+* the same entries in the same order and evict the same ones.
+*/
+
+AESD_RING_DEFINE(test_ring1, struct aesd_buffer_entry, 0)
+AESD_RING_DEFINE(test_ring8, struct aesd_buffer_entry, 3)
+AESD_RING_DEFINE(test_ring1024, struct aesd_buffer_entry, 10)
+
+static char payload[64];
+
+static uint32_t next_random(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+/**
+* Instantiates the comparison for one ring type, so each capacity is checked with its own
+* generated functions.
+*/
+#define DEFINE_RING_EQUIVALENCE(ring)                                                           \
+static void ring##_check_equivalent(struct aesd_circular_buffer *buffer, struct ring *r)       \
+{                                                                                               \
+    uint32_t count = aesd_circular_buffer_count(buffer);                                        \
+    uint32_t i;                                                                                 \
+                                                                                                \
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(count, ring##_count(r), "Entry counts differ");            \
+    TEST_ASSERT_EQUAL_MESSAGE(buffer->full, ring##_full(r), "Full flags differ");               \
+    TEST_ASSERT_EQUAL_MESSAGE(count == 0, ring##_empty(r), "Empty flags differ");               \
+    for (i = 0; i < count; i++) {                                                               \
+        struct aesd_buffer_entry *expected =                                                    \
+            &buffer->entry[(buffer->out_offs + i) % buffer->capacity];                          \
+        struct aesd_buffer_entry *actual = ring##_peek(r, i);                                   \
+        TEST_ASSERT_NOT_NULL_MESSAGE(actual, "Stored entry missing from ring");                 \
+        TEST_ASSERT_EQUAL_PTR(expected->buffptr, actual->buffptr);                              \
+        TEST_ASSERT_EQUAL_size_t(expected->size, actual->size);                                 \
+    }                                                                                           \
+    TEST_ASSERT_NULL_MESSAGE(ring##_peek(r, count), "Ring returned an entry past its count");   \
+}                                                                                               \
+                                                                                                \
+static void ring##_run_equivalence(uint32_t steps, uint32_t seed)                              \
+{                                                                                               \
+    struct aesd_buffer_entry *storage = calloc(ring##_capacity(), sizeof(*storage));            \
+    struct aesd_circular_buffer buffer;                                                         \
+    struct ring *r = malloc(sizeof(*r));                                                        \
+    uint32_t state = seed;                                                                      \
+    uint32_t step;                                                                              \
+                                                                                                \
+    TEST_ASSERT_NOT_NULL(storage);                                                              \
+    TEST_ASSERT_NOT_NULL(r);                                                                    \
+    aesd_circular_buffer_init_storage(&buffer, storage, ring##_capacity());                     \
+    ring##_init(r);                                                                             \
+    for (step = 0; step < steps; step++) {                                                      \
+        uint32_t op = next_random(&state);                                                      \
+        if (op % 4 != 0) {                                                                      \
+            struct aesd_buffer_entry entry = {                                                  \
+                .buffptr = &payload[op % sizeof(payload)],                                      \
+                .size = op % 1000,                                                              \
+            };                                                                                  \
+            struct aesd_buffer_entry oldest = buffer.entry[buffer.out_offs];                    \
+            struct aesd_buffer_entry evicted;                                                   \
+            bool was_full = buffer.full;                                                        \
+            aesd_circular_buffer_add_entry(&buffer, &entry);                                    \
+            TEST_ASSERT_EQUAL(was_full, ring##_push_overwrite(r, &entry, &evicted));            \
+            if (was_full) {                                                                     \
+                TEST_ASSERT_EQUAL_PTR(oldest.buffptr, evicted.buffptr);                         \
+                TEST_ASSERT_EQUAL_size_t(oldest.size, evicted.size);                            \
+            }                                                                                   \
+        } else {                                                                                \
+            struct aesd_buffer_entry expected, actual;                                          \
+            bool removed = aesd_circular_buffer_remove_oldest(&buffer, &expected);              \
+            TEST_ASSERT_EQUAL(removed, ring##_pop(r, &actual));                                 \
+            if (removed) {                                                                      \
+                TEST_ASSERT_EQUAL_PTR(expected.buffptr, actual.buffptr);                        \
+                TEST_ASSERT_EQUAL_size_t(expected.size, actual.size);                           \
+            }                                                                                   \
+        }                                                                                       \
+        ring##_check_equivalent(&buffer, r);                                                    \
+    }                                                                                           \
+    free(r);                                                                                    \
+    free(storage);                                                                              \
+}
+
+DEFINE_RING_EQUIVALENCE(test_ring1)
+DEFINE_RING_EQUIVALENCE(test_ring8)
+DEFINE_RING_EQUIVALENCE(test_ring1024)
+
+void test_aesd_ring_equivalent_to_circular_buffer()
+{
+    test_ring1_run_equivalence(1000, 1);
+    test_ring8_run_equivalence(10000, 2);
+    test_ring1024_run_equivalence(10000, 3);
+}
+
+void test_aesd_ring_push_pop_limits()
+{
+    struct test_ring8 r;
+    struct aesd_buffer_entry entry = { .buffptr = payload };
+    uint32_t i;
+
+    test_ring8_init(&r);
+    TEST_ASSERT_FALSE(test_ring8_pop(&r, NULL));
+    for (i = 0; i < test_ring8_capacity(); i++) {
+        entry.size = i;
+        TEST_ASSERT_TRUE(test_ring8_push(&r, &entry));
+    }
+    TEST_ASSERT_TRUE(test_ring8_full(&r));
+    TEST_ASSERT_FALSE_MESSAGE(test_ring8_push(&r, &entry), "Push into a full ring must fail");
+    TEST_ASSERT_EQUAL_size_t(0, test_ring8_peek(&r, 0)->size);
+    TEST_ASSERT_EQUAL_size_t(7, test_ring8_peek(&r, 7)->size);
+}
+
+void test_aesd_ring_index_wraparound()
+{
+    struct test_ring8 r;
+    struct aesd_buffer_entry entry = { .buffptr = payload };
+    struct aesd_buffer_entry popped;
+    uint32_t i;
+
+    /* Start just below the uint32_t limit so the free running indices wrap */
+    r.in = r.out = UINT32_MAX - 3;
+    for (i = 0; i < 20; i++) {
+        entry.size = i;
+        test_ring8_push_overwrite(&r, &entry, NULL);
+        TEST_ASSERT_EQUAL_UINT32(i < 8 ? i + 1 : 8, test_ring8_count(&r));
+    }
+    for (i = 12; i < 20; i++) {
+        TEST_ASSERT_TRUE(test_ring8_pop(&r, &popped));
+        TEST_ASSERT_EQUAL_size_t(i, popped.size);
+    }
+    TEST_ASSERT_TRUE(test_ring8_empty(&r));
+}
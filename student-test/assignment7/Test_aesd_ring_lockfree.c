@@ -0,0 +1,141 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include "../../aesd-char-driver/aesd-ring-lockfree.h"
+
+/**
+* Stress tests for the lock-free rings: producer threads push numbered elements through a small
+* ring, so it is full and empty many times over, and the consumer checks that every element
+* arrives exactly once and in each producer's order.
+*/
+
+#define STRESS_ITEMS 200000
+#define STRESS_PRODUCERS 4
+
+struct stress_item
+{
+    uint32_t producer;
+    uint32_t seq;
+    uint64_t check;     /* derived from producer and seq, catches torn copies */
+};
+
+AESD_SPSC_RING_DEFINE(stress_spsc, struct stress_item, 4)
+AESD_MPSC_RING_DEFINE(stress_mpsc, struct stress_item, 4)
+
+static uint64_t item_check(uint32_t producer, uint32_t seq)
+{
+    return ((uint64_t)producer << 32 | seq) * 0x9e3779b97f4a7c15ull;
+}
+
+struct stress_producer
+{
+    void *ring;
+    uint32_t id;
+};
+
+static void *spsc_producer(void *arg)
+{
+    struct stress_producer *producer = arg;
+    uint32_t seq;
+
+    for (seq = 0; seq < STRESS_ITEMS; seq++) {
+        struct stress_item item = { producer->id, seq, item_check(producer->id, seq) };
+        while (!stress_spsc_push(producer->ring, &item))
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void *mpsc_producer(void *arg)
+{
+    struct stress_producer *producer = arg;
+    uint32_t seq;
+
+    for (seq = 0; seq < STRESS_ITEMS; seq++) {
+        struct stress_item item = { producer->id, seq, item_check(producer->id, seq) };
+        while (!stress_mpsc_push(producer->ring, &item))
+            sched_yield();
+    }
+    return NULL;
+}
+
+void test_aesd_spsc_ring_stress()
+{
+    struct stress_spsc *ring = aligned_alloc(AESD_RING_CACHE_LINE, sizeof(*ring));
+    struct stress_producer producer = { ring, 0 };
+    struct stress_item item;
+    pthread_t thread;
+    uint32_t expected = 0;
+
+    TEST_ASSERT_NOT_NULL(ring);
+    stress_spsc_init(ring);
+    TEST_ASSERT_FALSE_MESSAGE(stress_spsc_pop(ring, &item), "Pop from an empty ring must fail");
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&thread, NULL, spsc_producer, &producer));
+    while (expected < STRESS_ITEMS) {
+        if (!stress_spsc_pop(ring, &item)) {
+            sched_yield();
+            continue;
+        }
+        TEST_ASSERT_EQUAL_UINT32_MESSAGE(expected, item.seq, "Element lost or out of order");
+        TEST_ASSERT_TRUE_MESSAGE(item.check == item_check(0, item.seq), "Torn element");
+        expected++;
+    }
+    pthread_join(thread, NULL);
+    TEST_ASSERT_FALSE_MESSAGE(stress_spsc_pop(ring, &item), "Element popped twice");
+    free(ring);
+}
+
+void test_aesd_mpsc_ring_stress()
+{
+    struct stress_mpsc *ring = aligned_alloc(AESD_RING_CACHE_LINE, sizeof(*ring));
+    struct stress_producer producers[STRESS_PRODUCERS];
+    pthread_t threads[STRESS_PRODUCERS];
+    uint32_t expected[STRESS_PRODUCERS] = { 0 };
+    struct stress_item item;
+    uint32_t received = 0;
+    uint32_t i;
+
+    TEST_ASSERT_NOT_NULL(ring);
+    stress_mpsc_init(ring);
+    TEST_ASSERT_FALSE_MESSAGE(stress_mpsc_pop(ring, &item), "Pop from an empty ring must fail");
+    for (i = 0; i < STRESS_PRODUCERS; i++) {
+        producers[i].ring = ring;
+        producers[i].id = i;
+        TEST_ASSERT_EQUAL_INT(0, pthread_create(&threads[i], NULL, mpsc_producer, &producers[i]));
+    }
+    while (received < STRESS_ITEMS * STRESS_PRODUCERS) {
+        if (!stress_mpsc_pop(ring, &item)) {
+            sched_yield();
+            continue;
+        }
+        TEST_ASSERT_TRUE_MESSAGE(item.producer < STRESS_PRODUCERS, "Element from nowhere");
+        TEST_ASSERT_EQUAL_UINT32_MESSAGE(expected[item.producer], item.seq,
+                                         "Element lost or out of producer order");
+        TEST_ASSERT_TRUE_MESSAGE(item.check == item_check(item.producer, item.seq), "Torn element");
+        expected[item.producer]++;
+        received++;
+    }
+    for (i = 0; i < STRESS_PRODUCERS; i++)
+        pthread_join(threads[i], NULL);
+    TEST_ASSERT_FALSE_MESSAGE(stress_mpsc_pop(ring, &item), "Element popped twice");
+    free(ring);
+}
+
+void test_aesd_lockfree_ring_full()
+{
+    struct stress_mpsc *ring = aligned_alloc(AESD_RING_CACHE_LINE, sizeof(*ring));
+    struct stress_item item = { 0 };
+    uint32_t i;
+
+    TEST_ASSERT_NOT_NULL(ring);
+    stress_mpsc_init(ring);
+    for (i = 0; i < stress_mpsc_capacity(); i++)
+        TEST_ASSERT_TRUE(stress_mpsc_push(ring, &item));
+    TEST_ASSERT_FALSE_MESSAGE(stress_mpsc_push(ring, &item), "Push into a full ring must fail");
+    TEST_ASSERT_TRUE(stress_mpsc_pop(ring, &item));
+    TEST_ASSERT_TRUE_MESSAGE(stress_mpsc_push(ring, &item), "Popped slot not reusable");
+    free(ring);
+}